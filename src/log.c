@@ -23,10 +23,12 @@
 
 #include "log.h"
 
+// The log is reached through this rather than SFS_DATA, since the
+// low-level API has no fuse_get_context() to find sfs_state through
+static FILE *logfile = NULL;
+
 FILE *log_open()
 {
-    FILE *logfile;
-    
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.
     logfile = fopen("sfs.log", "w");
@@ -46,7 +48,8 @@ void log_msg(const char *format, ...)
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(SFS_DATA->logfile, format, ap);
+    vfprintf(logfile, format, ap);
+    va_end(ap);
 }
 
 // fuse context
@@ -0,0 +1,112 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The LZ4 block format codec compressed clusters are kept in, see 
+  "Compression" in sfs.c.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "sfs.h"
+
+# define min(x, y) ((x < y) ? x : y)
+
+/**
+ * Writes the part of a length past the 15 that fit in a token, as bytes
+ * of 255 then the rest. Returns where the next byte goes.
+ */
+unsigned char *lz4Length(unsigned char *op, int len) {
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * Compresses len (at most 65536) bytes of src into dst, taking the first
+ * match the hash table turns up. Returns the compressed length, or 0 if 
+ * it won't fit in cap bytes.
+ */
+int lz4Compress(const char *src, int len, char *dst, int cap) {
+	uint16_t table[1 << LZ4_HASH_BITS];
+	unsigned char *op = (unsigned char *) dst, *token, *end = op + cap;
+	int ip = 0, anchor = 0, ref, lit, match;
+	uint32_t seq;
+	
+	memset(table, 0, sizeof(table));
+	while (ip < len - LZ4_MF_LIMIT) {
+		memcpy(&seq, src + ip, sizeof(seq));
+		seq = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		ref = table[seq];
+		table[seq] = ip;
+		// the table only hints, so the bytes are compared
+		if (ref >= ip || memcmp(src + ref, src + ip, LZ4_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		match = LZ4_MIN_MATCH;
+		while (ip + match < len - LZ4_LAST_LITERALS && src[ref + match] == src[ip + match]) match++;
+		lit = ip - anchor;
+		// token, literal length, literals, offset, match length
+		if (op + 5 + lit / 255 + lit + match / 255 > end) return 0;
+		token = op++;
+		*token = min(lit, 15) << 4 | min(match - LZ4_MIN_MATCH, 15);
+		if (lit >= 15) op = lz4Length(op, lit - 15);
+		memcpy(op, src + anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if (match - LZ4_MIN_MATCH >= 15) op = lz4Length(op, match - LZ4_MIN_MATCH - 15);
+		ip += match;
+		anchor = ip;
+	}
+	lit = len - anchor;
+	if (op + 2 + lit / 255 + lit > end) return 0;
+	*op++ = min(lit, 15) << 4;
+	if (lit >= 15) op = lz4Length(op, lit - 15);
+	memcpy(op, src + anchor, lit);
+	return op + lit - (unsigned char *) dst;
+}
+
+/**
+ * Decompresses the len bytes of src into dst, which holds cap bytes. 
+ * Returns the decompressed length, or -1 if src isn't valid or won't fit.
+ */
+int lz4Decompress(const char *src, int len, char *dst, int cap) {
+	const unsigned char *ip = (const unsigned char *) src, *end = ip + len;
+	int op = 0, token, lit, match, offset, more;
+	
+	while (ip < end) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip == end) return -1;
+				lit += more = *ip++;
+			} while (more == 255);
+		}
+		if (lit > end - ip || lit > cap - op) return -1;
+		memcpy(dst + op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == end) break;
+		
+		if (end - ip < 2) return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op) return -1;
+		match = (token & 15) + LZ4_MIN_MATCH;
+		if ((token & 15) == 15) {
+			do {
+				if (ip == end) return -1;
+				match += more = *ip++;
+			} while (more == 255);
+		}
+		if (match > cap - op) return -1;
+		// the match can run into the bytes it produces, so byte by byte
+		for (; match > 0; match--, op++) dst[op] = dst[op - offset];
+	}
+	return op;
+}
@@ -0,0 +1,13 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+unsigned char *lz4Length(unsigned char *op, int len);
+int lz4Compress(const char *src, int len, char *dst, int cap);
+int lz4Decompress(const char *src, int len, char *dst, int cap);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Checks the LZ4 codec in lz4.c, run by make check. Exits non-zero if 
+  any case fails.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "sfs.h"
+
+# define max(x, y) ((x > y) ? x : y)
+
+/**
+ * Fills src with size bytes of the given kind: bytes that don't 
+ * compress, one byte over and over, or literal runs longer than 255 
+ * between matches.
+ */
+void fill(char *src, int size, int kind) {
+	uint32_t x = 2463534242U;
+	int i;
+	for (i=0; i<size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		if (kind == 0) src[i] = x;
+		else if (kind == 1) src[i] = 'a';
+		// 1000 random bytes, then 24 repeating the 16 before them
+		else src[i] = (i % 1024 < 1000) ? (char) x : src[i - 16];
+	}
+}
+
+/**
+ * Checks that the size bytes of src come back out of LZ4 as they went 
+ * in. Returns their compressed length, or 0 if they don't.
+ */
+int roundTrip(const char *src, int size, char *dst, char *back) {
+	int n = lz4Compress(src, size, dst, 2 * size);
+	if (n <= 0 || lz4Decompress(dst, n, back, size) != size || memcmp(src, back, size) != 0) {
+		return 0;
+	}
+	return n;
+}
+
+/**
+ * Checks that compressing src into less room than the n bytes it takes
+ * is turned down without a byte written past that room.
+ */
+bool capped(const char *src, int size, char *dst, int n) {
+	int i, cap;
+	for (cap = max(0, n - 8); cap < n; cap++) {
+		memset(dst, 0xA5, 2 * size);
+		if (lz4Compress(src, size, dst, cap) != 0) return false;
+		for (i=cap; i<n; i++) {
+			if ((unsigned char) dst[i] != 0xA5) return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	const char *kinds[] = { "random", "repeated", "long literals" };
+	int n, kind, failed = 0, size = CLUSTER_BLOCKS * BLOCK_SIZE;
+	char *src = malloc(size), *dst = malloc(2 * size), *back = malloc(size);
+	
+	for (kind=0; kind<3; kind++) {
+		fill(src, size, kind);
+		if ((n = roundTrip(src, size, dst, back)) == 0) {
+			printf("FAIL %s: round trip\n", kinds[kind]);
+			failed++;
+		} else if (!capped(src, size, dst, n)) {
+			printf("FAIL %s: output cap\n", kinds[kind]);
+			failed++;
+		} else {
+			printf("ok %s\n", kinds[kind]);
+		}
+	}
+	free(src);
+	free(dst);
+	free(back);
+	return failed != 0;
+}
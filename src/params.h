@@ -20,6 +20,9 @@
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+// and this to get fallocate(), to punch freed blocks out of the image
+#define _GNU_SOURCE
+
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
@@ -30,13 +33,32 @@
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    char *mountpoint;
     FILE *flatFile;
 	struct SuperBlock *superblock;
 	char *bitmap;
 	INode *curNode;
 	FileHandle *handles;
+	
+	// mount options, see sfs_opts in sfs.c
+	int lowLevel;
+	int throughput;
+	double attrTimeout, entryTimeout;
+	int keepCache;
+	int atimeMode;
+	int compress;
+	int dedup;
+	int discard;
 };
 
+// atimeMode values; relatime is the default
+#define ATIME_RELATIME		0
+#define ATIME_STRICT		1
+#define ATIME_NOATIME		2
+
+// under relatime, atime is still written once it is this old (seconds)
+#define RELATIME_WINDOW	(24*60*60)
+
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
 #endif
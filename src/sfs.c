@@ -14,20 +14,29 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/falloc.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "log.h"
+#include "lz4.h"
 #include "sfs.h"
 
 /***********************************************************************
@@ -37,500 +46,4479 @@
  ***********************************************************************/
 
 FILE *flatFile = NULL;
+int diskFd = -1;
 struct SuperBlock *superblock = NULL;
 char *bitmap = NULL;
 FileHandle *handles;
+DCacheEntry *dcache = NULL;
+INodeRef *refs = NULL;
+
+// partial block writes that had to read the block first, and those that 
+// didn't. Updated with atomic adds, since writers of different files run 
+// at the same time; logged on unmount
+unsigned long rmwReads = 0, rmwReadsSaved = 0;
+
+// how reads update atime, from the mount options
+int atimeMode = ATIME_RELATIME;
+
+// whether new files are compressed, from the mount options, and the 
+// clusters of them written compressed and raw; logged on unmount
+bool compressFiles = false;
+unsigned long packedClusters = 0, rawClusters = 0;
+
+// whether new files are deduplicated, from the mount options, and the 
+// blocks written that turned out to be copies; logged on unmount
+bool dedupFiles = false;
+unsigned long dedupHits = 0;
+
+// bytes of zeroes written as holes rather than blocks; logged on unmount
+unsigned long zeroBytes = 0;
+
+// the kernel's ID for this mount, which the source of a clone must be on,
+// -1 if it couldn't be found
+int mountID = -1;
+
+// the transaction each block was last freed in, and the latest of them;
+// a block isn't reused for file data until that has committed
+uint32_t *freedTxn = NULL;
+uint32_t lastFreedTxn = 0;
+
+// whether freed blocks are punched out of the image, from the mount 
+// options, the blocks waiting for that, and the thread that does it, 
+// see "Discard"
+bool discardBlocks = false;
+BlockList discards = { NULL, 0, 0 };
+unsigned long discardedBlocks = 0;
+pthread_t discardThread;
+bool discardRunning = false, discardStopping = false;
+
+// decompressed clusters, see "Compression"
+CCacheEntry *ccache = NULL;
+
+// append buffers and the thread that writes them out, see "Append buffers"
+TailBuf *tails = NULL;
+// files waiting for their tails to be packed, see "Tail packing"
+INodeID *packs = NULL;
+int packCount = 0;
+pthread_t flusherThread;
+bool stopping = false;
+
+// the thread that frees the blocks of orphans, see "Orphans"
+pthread_t reaperThread;
+bool reaperStopping = false;
+
+// the journal cache, the blocks changed in the running transaction, and
+// the thread that commits them, see "Journal"
+JBlock **jcache = NULL;
+JBlock **dirtyBlocks = NULL;
+int dirtyCount = 0, dirtySize = 0;
+uint32_t runningTxn = 1, committedTxn = 0;
+bool commitWanted = false, committerRunning = false, committerStopping = false;
+pthread_t committerThread;
+// room in the running transaction set aside for the operations in flight
+int txnReserved = 0;
+// how deep the calling thread is in beginOp(), and how much of the room
+// its operation set aside is left
+__thread int opDepth = 0;
+__thread int opRoom = 0;
+
+/*
+ * Locking. Locks are always taken in the order they are listed here.
+ * 
+ * snapLock lets one snapshot be taken or dropped at a time. It's held 
+ * across the many operations either one runs, so it comes before them.
+ * freezeLock is held for reading by every change a user asks for, from
+ * before its first operation to after its last, and for writing while a
+ * snapshot is copied, see beginChange().
+ * txnLock is held for reading by every operation that changes anything,
+ * and for writing while a transaction is sealed, see "Journal".
+ * nsLock guards the directory tree: held for reading while resolving paths
+ * or listing directories, and for writing by anything that adds, removes
+ * or moves a directory entry.
+ * inodeLocks guard the contents of files, held for reading by readers of a
+ * file and for writing by anything that changes its size or blocks.
+ * allocLock guards the superblock, the bitmap, INode allocation, the
+ * transactions blocks were freed in, the orphan list and the discard
+ * queue; orphanCond is signalled with it when an orphan is queued, and
+ * discardCond when the discard queue fills up.
+ * handleLock, dcacheLock and refLock guard the handle table, the lookup
+ * cache and the kernel's INode references. tailLock guards which append
+ * buffers are in use and which tails wait to be packed, and ccacheLock
+ * the cluster cache. journalLock guards the journal cache and the room
+ * set aside in it; journalCond wakes the committer, commitCond is
+ * signalled after each commit, and roomCond whenever room in the running
+ * transaction is given back.
+ */
+pthread_mutex_t snapLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t freezeLock;
+pthread_rwlock_t txnLock;
+pthread_rwlock_t nsLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inodeLocks[INODE_LOCKS];
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dcacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t refLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t tailLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ccacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tailCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t orphanCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t discardCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t roomCond = PTHREAD_COND_INITIALIZER;
 
 void loadGlobals() {
+	// main() sets these up before any thread starts, so they are only
+	// written here if that hasn't happened
+	if (flatFile != NULL) return;
 	struct sfs_state *data = SFS_DATA;
 	flatFile = data->flatFile;
+	diskFd = fileno(flatFile);
 	superblock = data->superblock;
 	bitmap = data->bitmap;
 }
 
+void lockINode(INodeID id, bool write) {
+	if (write) {
+		pthread_rwlock_wrlock(&(inodeLocks[id % INODE_LOCKS]));
+	} else {
+		pthread_rwlock_rdlock(&(inodeLocks[id % INODE_LOCKS]));
+	}
+}
+
+void unlockINode(INodeID id) {
+	pthread_rwlock_unlock(&(inodeLocks[id % INODE_LOCKS]));
+}
+
+/**
+ * Locks two INodes for writing, in the order of their locks, and only 
+ * once if they share one.
+ */
+void lockINodePair(INodeID a, INodeID b) {
+	if (a % INODE_LOCKS > b % INODE_LOCKS) {
+		lockINodePair(b, a);
+		return;
+	}
+	lockINode(a, true);
+	if (a % INODE_LOCKS != b % INODE_LOCKS) lockINode(b, true);
+}
+
+void unlockINodePair(INodeID a, INodeID b) {
+	unlockINode(a);
+	if (a % INODE_LOCKS != b % INODE_LOCKS) unlockINode(b);
+}
+
+# define min(x, y) ((x < y) ? x : y)
+# define max(x, y) ((x > y) ? x : y)
+
 /***********************************************************************
  * 
- * Low level IO functions
+ * Journal
+ * 
+ * Metadata (the superblock, bitmap, INodes, directory, indirection and
+ * tail blocks) isn't written in place as it changes. The changed blocks
+ * are kept in the journal cache, where reads find them, and each FUSE 
+ * operation that changes anything runs between beginOp() and endOp().
+ * Every JOURNAL_INTERVAL seconds, once TXN_MAX blocks have changed, or
+ * when fsync asks, journalCommitter() waits for the operations in flight
+ * to finish and seals everything they changed as one transaction. The 
+ * sealed images go to the journal with a descriptor listing where they 
+ * belong, and are synced along with the file data written in place since
+ * the last commit; only then does the commit block carrying their 
+ * checksum go out, with a sync of its own, so the data is always on disk
+ * ahead of the metadata that points at it. Then the images are written 
+ * in place and synced again, which frees the journal for the next 
+ * transaction. Operations that run together commit together, so the 
+ * same syncs cover all of them. Each sets aside room
+ * in the transaction before it starts, so that together they never make
+ * more dirty than the journal holds.
+ * 
+ * At mount replayJournal() writes back a committed transaction that may
+ * not have reached its place. File data is written in place straight 
+ * away, and a block still in the journal cache isn't handed out again,
+ * so an old metadata image never lands on top of new data. Nor is a block
+ * freed since the last commit handed out for data: until the bitmap that
+ * frees it commits, a crash gives it back to the file that had it, and 
+ * new data written there would turn up in that file. Metadata can have
+ * it, since nothing written through the journal lands before the free.
  * 
  ***********************************************************************/
- 
+
 /**
- * Reads the block specified by id into the buffer. Buffer must be at least
- * superblock->blockSize in length.
+ * FNV-1a hash of len bytes at buf, continuing from hash.
  */
-void readBlock(BlockID id, void *buffer) {
-	if (handles != NULL) log_msg("\nREADING BLK %d OFF %d\n", id, id*superblock->blockSize);
-	fseek(flatFile, id*superblock->blockSize, SEEK_SET);
-	fread(buffer, superblock->blockSize, 1, flatFile);
+uint32_t checksum(uint32_t hash, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	size_t i;
+	for (i=0; i<len; i++) {
+		hash = (hash ^ p[i]) * 16777619;
+	}
+	return hash;
 }
 
 /**
- * Writes data from buffer into the block specified by id. Buffer must be
- * at least superblock->blockSize in length.
+ * Returns the journal cache's copy of the block id, or NULL. Caller holds
+ * journalLock.
  */
-void writeBlock(BlockID id, void *buffer) {
-	if (handles != NULL) log_msg("\nWRITING BLK %d OFF %d\n", id, id*superblock->blockSize);
-	fseek(flatFile, id*superblock->blockSize, SEEK_SET);
-	fwrite(buffer, superblock->blockSize, 1, flatFile);
-	fflush(flatFile);
+JBlock *findJBlock(BlockID id) {
+	JBlock *e;
+	for (e = jcache[id % JOURNAL_HASH]; e != NULL; e = e->next) {
+		if (e->id == id) return e;
+	}
+	return NULL;
 }
 
 /**
- * Reads the INode specified by id into the buffer curNode.
+ * Returns true if the block id has an image in the journal cache that 
+ * isn't in place yet.
  */
-void readINode(INodeID id, INode *curNode) {
-	if (handles != NULL) log_msg("\nREADING INODE %d FL: %d\n", id);
-	fseek(flatFile, id*sizeof(INode) + superblock->firstINodeBlock*superblock->blockSize, SEEK_SET);
-	fread(curNode, sizeof(INode), 1, flatFile);
+bool journalHas(BlockID id) {
+	bool found;
+	if (jcache == NULL) return false;
+	pthread_mutex_lock(&journalLock);
+	found = findJBlock(id) != NULL;
+	pthread_mutex_unlock(&journalLock);
+	return found;
 }
 
 /**
- * Writes curNode back to disk, into the INode specified by id.
+ * Reads len bytes at pos in the image into buffer, taking whatever the 
+ * journal cache has a newer copy of from there.
  */
-void writeINode(INodeID id, INode *curNode) {
-	if (handles != NULL) log_msg("\nWRITING INODE %d FL: %d\n", id, curNode->flags);
-	fseek(flatFile, id*sizeof(INode) + superblock->firstINodeBlock*superblock->blockSize, SEEK_SET);
-	fwrite(curNode, sizeof(INode), 1, flatFile);
-	fflush(flatFile);
+void readRange(off_t pos, void *buffer, size_t len) {
+	int blockSize = superblock->blockSize;
+	char *buf = buffer;
+	size_t count;
+	JBlock *e;
+	
+	while (len > 0) {
+		count = min(len, blockSize - pos % blockSize);
+		e = NULL;
+		if (jcache != NULL) {
+			pthread_mutex_lock(&journalLock);
+			if ((e = findJBlock(pos / blockSize)) != NULL) memcpy(buf, e->data + pos % blockSize, count);
+			pthread_mutex_unlock(&journalLock);
+		}
+		if (e == NULL) pread(diskFd, buf, count, pos);
+		buf += count;
+		pos += count;
+		len -= count;
+	}
 }
 
-/***********************************************************************
- * 
- * Allocation methods
- * 
- ***********************************************************************/
-
-void markBlockUsed(BlockID id) {
-	bitmap[id/8] |= 1 << (id % 8);
-	writeBlock(superblock->bitmapBlock, bitmap);
-	superblock->numFreeBlocks--;
-	writeBlock(0, superblock);
+/**
+ * Writes len bytes from buffer at pos in the image as metadata, into the
+ * journal cache as part of the running transaction. Until the journal is
+ * open it goes straight to disk.
+ */
+void writeRange(off_t pos, const void *buffer, size_t len) {
+	int blockSize = superblock->blockSize;
+	const char *buf = buffer;
+	char *data;
+	BlockID id;
+	size_t count;
+	JBlock *e;
+	
+	if (jcache == NULL) {
+		pwrite(diskFd, buffer, len, pos);
+		return;
+	}
+	pthread_mutex_lock(&journalLock);
+	while (len > 0) {
+		id = pos / blockSize;
+		count = min(len, blockSize - pos % blockSize);
+		if ((e = findJBlock(id)) == NULL) {
+			// the block is read without the lock, then looked for again, 
+			// since another operation may have cached it meanwhile. A 
+			// commit can't put it in place and drop it in between, as the
+			// caller's operation holds the next seal off
+			pthread_mutex_unlock(&journalLock);
+			data = malloc(blockSize);
+			pread(diskFd, data, blockSize, (off_t) id * blockSize);
+			pthread_mutex_lock(&journalLock);
+			if ((e = findJBlock(id)) != NULL) {
+				free(data);
+			} else {
+				e = malloc(sizeof(JBlock));
+				e->id = id;
+				e->dirty = false;
+				e->data = data;
+				e->next = jcache[id % JOURNAL_HASH];
+				jcache[id % JOURNAL_HASH] = e;
+			}
+		}
+		memcpy(e->data + pos % blockSize, buf, count);
+		if (!e->dirty) {
+			e->dirty = true;
+			if (opRoom > 0) {
+				opRoom--;
+				txnReserved--;
+			}
+			if (dirtyCount == dirtySize) {
+				dirtySize *= 2;
+				dirtyBlocks = realloc(dirtyBlocks, dirtySize * sizeof(JBlock *));
+			}
+			dirtyBlocks[dirtyCount++] = e;
+		}
+		e->txn = runningTxn;
+		buf += count;
+		pos += count;
+		len -= count;
+	}
+	pthread_mutex_unlock(&journalLock);
 }
 
-void markBlockFree(BlockID id) {
-	// don't allow anyone to mark INodes or superblock as unused
-	if (id < superblock->firstDataBlock) return;
-	bitmap[id/8] &= bitmap[id/8] & ~(1 << (id % 8));
-	writeBlock(superblock->bitmapBlock, bitmap);
-	superblock->numFreeBlocks++;
-	writeBlock(0, superblock);
+/**
+ * Starts a change to the filesystem that makes at most room blocks of 
+ * metadata dirty, which will commit along with the rest of the running 
+ * transaction. Waits first if that transaction is already full, or if 
+ * the room isn't left in it beside what the operations in flight set 
+ * aside. Calls nest; only the outermost one sets room aside.
+ */
+void beginOpRoom(int room) {
+	if (opDepth++ > 0 || jcache == NULL) return;
+	pthread_mutex_lock(&journalLock);
+	while (committerRunning && (dirtyCount >= TXN_MAX || dirtyCount + txnReserved + room > TXN_CAPACITY)) {
+		// the operations in flight can make room by ending; only what's
+		// dirty already needs a commit
+		if (dirtyCount > 0) {
+			commitWanted = true;
+			pthread_cond_signal(&journalCond);
+		}
+		pthread_cond_wait(&roomCond, &journalLock);
+	}
+	txnReserved += room;
+	opRoom = room;
+	pthread_mutex_unlock(&journalLock);
+	pthread_rwlock_rdlock(&txnLock);
 }
 
-void markINodeUsed(INodeID id) {
-	INode curNode;
-	readINode(id, &curNode);
-	curNode.flags = INODE_IN_USE;
-	writeINode(id, &curNode);
-	superblock->numFreeINodes--;
-	writeBlock(0, superblock);
+/**
+ * Starts a change to the filesystem, see beginOpRoom().
+ */
+void beginOp() {
+	beginOpRoom(OP_BLOCKS);
 }
 
-void markINodeFree(INodeID id) {
-	INode curNode;
-	readINode(id, &curNode);
-	curNode.flags &= ~INODE_IN_USE;
-	writeINode(id, &curNode);
-	superblock->numFreeINodes++;
-	writeBlock(0, superblock);
+/**
+ * Starts a change to a file's blocks, see beginOpRoom().
+ */
+void beginBulkOp() {
+	beginOpRoom(OP_BULK);
 }
 
 /**
- * Finds the next unused INode and allocates it, then returns the ID. curNode
- * will contain the INode data upon exit.
+ * Ends a change started by beginOp(), giving back the room it didn't use.
  */
-INodeID allocateNextINode() {
-	int i;
-	INode curNode;
-	for (i=0; i<superblock->numINodes; i++) {
-		readINode(i, &curNode);
-		if (isFree((&curNode))) {
-			markINodeUsed(i);
-			return i;
-		}
+void endOp() {
+	if (--opDepth > 0 || jcache == NULL) return;
+	if (opRoom > 0) {
+		pthread_mutex_lock(&journalLock);
+		txnReserved -= opRoom;
+		opRoom = 0;
+		pthread_cond_broadcast(&roomCond);
+		pthread_mutex_unlock(&journalLock);
 	}
-	
-	return -1;
+	pthread_rwlock_unlock(&txnLock);
 }
 
 /**
- * Finds the next free data block on disk, and marks it as used in the bitmap.
- * Then returns the block ID of the newly allocated block.
+ * Starts a change asked for by a user, such as a write or a rename, 
+ * which runs one or more operations. It waits while a snapshot is 
+ * copied, so a snapshot sees each change whole or not at all. Caller 
+ * holds no locks.
  */
-BlockID allocateNextBlock() {
-	int i;
+void beginChange() {
+	pthread_rwlock_rdlock(&freezeLock);
+}
+
+/**
+ * Ends a change started by beginChange().
+ */
+void endChange() {
+	pthread_rwlock_unlock(&freezeLock);
+}
+
+/**
+ * Seals the running transaction, writes it through the journal, then puts
+ * it in place. Only called from journalCommitter(), or once the thread
+ * has stopped.
+ */
+void commitTxn() {
+	int i, n, first, count, blockSize = superblock->blockSize;
+	off_t start = (off_t) superblock->journalStart * blockSize;
+	JournalHeader *desc, *commit;
+	uint32_t seq;
+	BlockID *ids;
+	char *images;
+	JBlock *e, **prev;
 	
-	for (i=0; i<superblock->numBlocks; i++) {
-		char b = bitmap[i / 8];
-		if ((b & (1 << (i % 8))) == 0) {
-			markBlockUsed(i);
-			return i;
+	// seal: wait out the operations in flight and copy what they changed
+	pthread_rwlock_wrlock(&txnLock);
+	pthread_mutex_lock(&journalLock);
+	n = dirtyCount;
+	seq = runningTxn++;
+	ids = malloc(n * sizeof(BlockID));
+	images = malloc((size_t) n * blockSize);
+	for (i=0; i<n; i++) {
+		ids[i] = dirtyBlocks[i]->id;
+		memcpy(images + (size_t) i * blockSize, dirtyBlocks[i]->data, blockSize);
+		dirtyBlocks[i]->dirty = false;
+	}
+	dirtyCount = 0;
+	pthread_cond_broadcast(&commitCond);
+	pthread_cond_broadcast(&roomCond);
+	pthread_mutex_unlock(&journalLock);
+	pthread_rwlock_unlock(&txnLock);
+	
+	desc = calloc(blockSize, 1);
+	commit = calloc(blockSize, 1);
+	if (n > TXN_CAPACITY) {
+		// only an operation that made more dirty than it set aside gets 
+		// here. The transaction goes through the journal in pieces, each 
+		// committed before it's put in place, so none of it is ever 
+		// written in place unprotected, but a crash between pieces keeps
+		// only the first ones
+		log_msg("\ncommitTxn: %d blocks don't fit in the journal, committing in pieces\n", n);
+	}
+	for (first=0; first<n; first += count) {
+		count = min(n - first, TXN_CAPACITY);
+		memset(desc, 0, blockSize);
+		memcpy(desc->ids, ids + first, count * sizeof(BlockID));
+		desc->magic = JOURNAL_MAGIC;
+		desc->seq = seq;
+		desc->count = count;
+		desc->checksum = checksum(checksum(2166136261u, desc->ids, count * sizeof(BlockID)), 
+			images + (size_t) first * blockSize, (size_t) count * blockSize);
+		*commit = *desc;
+		commit->count = 0;
+		pwrite(diskFd, desc, blockSize, start + blockSize);
+		pwrite(diskFd, images + (size_t) first * blockSize, (size_t) count * blockSize, start + 2 * blockSize);
+		// the file data written since the last commit, the descriptor and
+		// the images are all on disk before the commit block can be, so 
+		// a commit that survives a crash never points at data that didn't
+		fdatasync(diskFd);
+		pwrite(diskFd, commit, blockSize, start + (off_t) (2 + count) * blockSize);
+		fdatasync(diskFd);
+		// checkpoint
+		for (i=first; i<first + count; i++) {
+			pwrite(diskFd, images + (size_t) i * blockSize, blockSize, (off_t) ids[i] * blockSize);
 		}
+		fdatasync(diskFd);
+	}
+	// then let the journal go
+	if (n > 0) {
+		memset(desc, 0, blockSize);
+		desc->magic = JOURNAL_MAGIC;
+		desc->seq = seq + 1;
+		pwrite(diskFd, desc, blockSize, start);
 	}
 	
-	return -1;
+	// whatever hasn't changed again is in place now
+	pthread_mutex_lock(&journalLock);
+	for (i=0; i<JOURNAL_HASH; i++) {
+		for (prev = &(jcache[i]); (e = *prev) != NULL; ) {
+			if (!e->dirty && e->txn <= seq) {
+				*prev = e->next;
+				free(e->data);
+				free(e);
+			} else {
+				prev = &(e->next);
+			}
+		}
+	}
+	committedTxn = seq;
+	pthread_cond_broadcast(&commitCond);
+	pthread_mutex_unlock(&journalLock);
+	free(ids);
+	free(images);
+	free(commit);
+	free(desc);
 }
 
-int allocateNextHandle() {
-	int i;
-	for (i=0; i<NUM_OPEN_FILES; i++) {
-		if (handles[i].inUse == false) {
-			// if the handle is free, allocate it
-			handles[i].inUse = true;
-			return i;
+/**
+ * Commits the running transaction every JOURNAL_INTERVAL seconds, or 
+ * sooner when it fills up or someone waits on it. Runs in its own thread
+ * from init until closeDisk(), committing once more on the way out.
+ */
+void *journalCommitter(void *arg) {
+	struct timespec wake;
+	pthread_mutex_lock(&journalLock);
+	while (!committerStopping) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += JOURNAL_INTERVAL;
+		while (!commitWanted && !committerStopping && dirtyCount < TXN_MAX) {
+			if (pthread_cond_timedwait(&journalCond, &journalLock, &wake) == ETIMEDOUT) break;
 		}
+		commitWanted = false;
+		pthread_mutex_unlock(&journalLock);
+		commitTxn();
+		pthread_mutex_lock(&journalLock);
 	}
-	
-	errno = ENFILE;
-	return -1;
+	committerRunning = false;
+	pthread_cond_broadcast(&commitCond);
+	pthread_cond_broadcast(&roomCond);
+	pthread_mutex_unlock(&journalLock);
+	commitTxn();
+	return NULL;
 }
 
-void freeHandle(int fd) {
-	handles[fd].inUse = false;
+/**
+ * Starts journalCommitter, if the journal is open.
+ */
+void startCommitter() {
+	if (jcache == NULL) return;
+	committerStopping = false;
+	committerRunning = true;
+	pthread_create(&committerThread, NULL, journalCommitter, NULL);
 }
 
-/***********************************************************************
- * 
- * FileEntry methods
- * 
- ***********************************************************************/
- 
-# define min(x, y) ((x < y) ? x : y)
-# define max(x, y) ((x > y) ? x : y)
+/**
+ * Stops journalCommitter, which commits whatever is left on its way out.
+ */
+void stopCommitter() {
+	bool running;
+	if (jcache == NULL) return;
+	pthread_mutex_lock(&journalLock);
+	running = committerRunning;
+	committerStopping = true;
+	pthread_cond_signal(&journalCond);
+	pthread_mutex_unlock(&journalLock);
+	if (running) pthread_join(committerThread, NULL);
+	else commitTxn();
+}
 
 /**
- * finds the file/directory specified by fname in dir. The BlockID pointer points
- * to a location to store the block in which the entry is located, and the index 
- * pointer points to a location to store the FileEntry's index in that block.
- * 
- * On success, returns the INodeID of the file/dir specified by fname, 
- * or -1 with errno set if an error occurs
+ * Waits until transaction txn is committed, asking for a commit if it's
+ * still running. Must not be called between beginOp() and endOp(), since
+ * the commit waits for those.
  */
-INodeID findFileEntry(INodeID dir, const char *fname, BlockID *block, int *index) {
-	BlockID blk = 0;
-	int i, count, remaining, entriesPerBlock;
-	FileEntry *ptr;
-	FileEntry *entries;
-	INode curNode;
-	
-	readINode(dir, &curNode);
-	
-	if (!isDir((&curNode))) {
-		// ensure this is a directory
-		errno = ENOTDIR;
-		return -1;
+void syncJournal(uint32_t txn) {
+	if (jcache == NULL) {
+		fdatasync(diskFd);
+		return;
+	}
+	pthread_mutex_lock(&journalLock);
+	if (committedTxn < txn) {
+		commitWanted = true;
+		pthread_cond_signal(&journalCond);
 	}
+	while (committedTxn < txn && committerRunning) {
+		pthread_cond_wait(&commitCond, &journalLock);
+	}
+	pthread_mutex_unlock(&journalLock);
+}
 
-	entries = malloc(superblock->blockSize);
-	remaining = curNode.childCount;
-	entriesPerBlock = superblock->blockSize / sizeof(FileEntry);
+/**
+ * Returns true if res is -ENOSPC and blocks freed since the last commit
+ * were kept from file data, once that has committed; the caller then 
+ * tries again. tries counts the retries, of which there is only one, 
+ * since a failed attempt can free blocks itself. Must not be called 
+ * inside an operation, like syncJournal().
+ */
+bool retryFreed(int res, int *tries) {
+	uint32_t txn;
+	if (res != -ENOSPC || jcache == NULL || (*tries)++ > 0) return false;
+	pthread_mutex_lock(&allocLock);
+	txn = lastFreedTxn;
+	pthread_mutex_unlock(&allocLock);
+	pthread_mutex_lock(&journalLock);
+	if (txn <= committedTxn) txn = 0;
+	pthread_mutex_unlock(&journalLock);
+	if (txn == 0) return false;
+	syncJournal(txn);
+	return true;
+}
+
+/**
+ * Writes back the transaction left in the journal, if it was committed.
+ * Called at mount, before anything else is read from the image.
+ */
+void replayJournal() {
+	int i, blockSize = superblock->blockSize;
+	off_t start = (off_t) superblock->journalStart * blockSize;
+	JournalHeader *header = malloc(blockSize), *desc = malloc(blockSize), *commit = malloc(blockSize);
+	char *images = NULL;
 	
-	// each iteration will read 1 block of data
-	while (remaining > 0) {
-		// read next block
-		readBlock(curNode.blocks[blk++], entries);
-		// read the remaining number of entries, or the whole blocks worth of entities
-		count = min(remaining, entriesPerBlock);
-		remaining -= count;
-		
-		for (i=0; i<count; i++) {
-			// iterate through each entry
-			ptr = &(entries[i]);
-			if (strcmp(ptr->value, fname) == 0) {
-				// found a match! 
-				int id = ptr->id;
-				free(entries);
-				*block = curNode.blocks[blk-1];
-				*index = i;
-				return id;
-			}
-		}
+	pread(diskFd, header, blockSize, start);
+	pread(diskFd, desc, blockSize, start + blockSize);
+	if (header->magic != JOURNAL_MAGIC || desc->magic != JOURNAL_MAGIC || 
+			desc->seq < header->seq || desc->count == 0 || desc->count > TXN_CAPACITY) {
+		goto done;
 	}
-	
-	free(entries);
-	errno = ENOENT;
-	return -1;
+	images = malloc((size_t) desc->count * blockSize);
+	pread(diskFd, images, (size_t) desc->count * blockSize, start + 2 * blockSize);
+	pread(diskFd, commit, blockSize, start + (off_t) (2 + desc->count) * blockSize);
+	// a transaction that was cut short doesn't match its checksum
+	if (commit->magic != JOURNAL_MAGIC || commit->seq != desc->seq || commit->checksum != desc->checksum ||
+			checksum(checksum(2166136261u, desc->ids, desc->count * sizeof(BlockID)), 
+				images, (size_t) desc->count * blockSize) != desc->checksum) {
+		goto done;
+	}
+	fprintf(stderr, "replaying journal: %d blocks\n", desc->count);
+	for (i=0; i<desc->count; i++) {
+		pwrite(diskFd, images + (size_t) i * blockSize, blockSize, (off_t) desc->ids[i] * blockSize);
+	}
+	fdatasync(diskFd);
+	header->seq = desc->seq + 1;
+	pwrite(diskFd, header, blockSize, start);
+	fdatasync(diskFd);
+done:
+	free(images);
+	free(commit);
+	free(desc);
+	free(header);
 }
 
 /**
- * Adds the given child to the specified parent directory INode. Returns the 
- * index the child was added at in the directory data blocks, or -1 if no
- * space is left to add the child.
+ * Sets aside count contiguous free blocks, at mount, before the journal
+ * is open. The bitmap is written out by the caller. Returns the first of 
+ * them, or 0 if there's no room.
  */
-int addFileEntry(INodeID dir, INodeID child, const char *fname) {
-	int childrenPerBlock = superblock->blockSize / sizeof(FileEntry);
-	int maxChildren = childrenPerBlock * 14;
-	INode curNode;
-	
-	readINode(dir, &curNode);
+BlockID reserveBlocks(int count) {
+	int i, start;
 	
-	if (curNode.childCount == maxChildren) {
-		errno = ENOSPC;
-		return -1;
+	for (start = superblock->firstDataBlock; start + count <= superblock->numBlocks; start = i + 1) {
+		for (i=start; i<start + count; i++) {
+			if (bitmap[i / 8] & (1 << (i % 8))) break;
+		}
+		if (i == start + count) break;
 	}
-	// blk = which direct block this child will be in
-	// index = which FileEntry the child is in the block
-	int blk = curNode.childCount / childrenPerBlock;
-	int index = curNode.childCount % childrenPerBlock;
-	
-	if (curNode.blocks[blk] == 0) {
-		// if we are in an unallocated block
-		curNode.blocks[blk] = allocateNextBlock();
-		if (curNode.blocks[blk] == (BlockID) -1) return -1;
-		curNode.size += superblock->blockSize;
+	if (start + count > superblock->numBlocks) return 0;
+	for (i=start; i<start + count; i++) {
+		bitmap[i / 8] |= 1 << (i % 8);
+		superblock->regionFree[i / REGION_BLOCKS]--;
 	}
-	
-	FileEntry *block = malloc(superblock->blockSize);
-	readBlock(curNode.blocks[blk], block);
-	FileEntry *entry = &(block[index]);
-	// copy in name and ID
-	strcpy(entry->value, fname);
-	entry->id = child;
-	// write directory block back
-	writeBlock(curNode.blocks[blk], block);
-	curNode.childCount++;
-	// write INode back
-	writeINode(dir, &curNode);
-	free(block);
-	return curNode.childCount - 1;
+	superblock->numFreeBlocks -= count;
+	return start;
 }
 
 /**
- * Removes file specified by fname from the directory listing of dir, by
+ * Sets aside JOURNAL_BLOCKS contiguous free blocks for the journal, for a
+ * new image or one made before there was a journal. Leaves the image 
+ * without one if there's no room.
+ */
+void createJournal() {
+	int blockSize = superblock->blockSize;
+	BlockID start;
+	JournalHeader *header;
+	
+	if ((start = reserveBlocks(JOURNAL_BLOCKS)) == 0) {
+		fprintf(stderr, "no room for a journal, running without one\n");
+		return;
+	}
+	header = calloc(blockSize, 1);
+	header->magic = JOURNAL_MAGIC;
+	header->seq = 1;
+	pwrite(diskFd, header, blockSize, (off_t) start * blockSize);
+	free(header);
+	superblock->journalStart = start;
+	pwrite(diskFd, bitmap, blockSize, (off_t) superblock->bitmapBlock * blockSize);
+	pwrite(diskFd, superblock, blockSize, 0);
+	fdatasync(diskFd);
+}
+
+/**
+ * Opens the journal, so that metadata writes from here on go through it.
+ */
+void openJournal() {
+	JournalHeader *header;
+	if (superblock->journalStart == 0) return;
+	header = malloc(superblock->blockSize);
+	pread(diskFd, header, superblock->blockSize, (off_t) superblock->journalStart * superblock->blockSize);
+	runningTxn = header->seq;
+	committedTxn = header->seq - 1;
+	free(header);
+	dirtySize = TXN_MAX;
+	dirtyBlocks = malloc(dirtySize * sizeof(JBlock *));
+	jcache = calloc(JOURNAL_HASH, sizeof(JBlock *));
+}
+
+/**
+ * Frees the journal cache once the committer has put everything in place.
+ */
+void closeJournal() {
+	int i;
+	JBlock *e;
+	if (jcache == NULL) return;
+	for (i=0; i<JOURNAL_HASH; i++) {
+		while ((e = jcache[i]) != NULL) {
+			jcache[i] = e->next;
+			free(e->data);
+			free(e);
+		}
+	}
+	free(jcache);
+	free(dirtyBlocks);
+	jcache = NULL;
+}
+
+/***********************************************************************
+ * 
+ * Low level IO functions
+ * 
+ ***********************************************************************/
+ 
+/*
+ * These use pread()/pwrite() on the image's descriptor rather than the
+ * FILE's seek pointer, so any number of threads can do IO at once. Reads
+ * see the journal cache; writes other than writeFileBlock() are metadata
+ * and go through it.
+ */
+
+/**
+ * Reads the block specified by id into the buffer. Buffer must be at least
+ * superblock->blockSize in length.
+ */
+void readBlock(BlockID id, void *buffer) {
+	if (handles != NULL) log_msg("\nREADING BLK %d OFF %d\n", id, id*superblock->blockSize);
+	readRange((off_t) id*superblock->blockSize, buffer, superblock->blockSize);
+}
+
+/**
+ * Writes data from buffer into the block specified by id. Buffer must be
+ * at least superblock->blockSize in length.
+ */
+void writeBlock(BlockID id, void *buffer) {
+	if (handles != NULL) log_msg("\nWRITING BLK %d OFF %d\n", id, id*superblock->blockSize);
+	writeRange((off_t) id*superblock->blockSize, buffer, superblock->blockSize);
+}
+
+/**
+ * Writes a block of file data from buffer straight into its place.
+ */
+void writeFileBlock(BlockID id, void *buffer) {
+	if (handles != NULL) log_msg("\nWRITING DATA BLK %d\n", id);
+	pwrite(diskFd, buffer, superblock->blockSize, (off_t) id*superblock->blockSize);
+}
+
+/**
+ * Reads len bytes at offset within the block id into buffer.
+ */
+void readBlockPart(BlockID id, void *buffer, int offset, int len) {
+	readRange((off_t) id*superblock->blockSize + offset, buffer, len);
+}
+
+/**
+ * Writes len bytes from buffer at offset within the block id.
+ */
+void writeBlockPart(BlockID id, void *buffer, int offset, int len) {
+	writeRange((off_t) id*superblock->blockSize + offset, buffer, len);
+}
+
+/**
+ * Reads the INode specified by id into the buffer curNode.
+ */
+void readINode(INodeID id, INode *curNode) {
+	if (handles != NULL) log_msg("\nREADING INODE %d\n", id);
+	readRange((off_t) id*sizeof(INode) + (off_t) superblock->firstINodeBlock*superblock->blockSize, 
+		curNode, sizeof(INode));
+}
+
+/**
+ * Writes curNode back to disk, into the INode specified by id.
+ */
+void writeINode(INodeID id, INode *curNode) {
+	INode old;
+	if (handles != NULL) log_msg("\nWRITING INODE %d FL: %d\n", id, curNode->flags);
+	if (jcache != NULL) {
+		// note what an fsync of the file has to wait for. fdatasync 
+		// doesn't wait for the times
+		readINode(id, &old);
+		old.lastAccess = curNode->lastAccess;
+		old.lastModify = curNode->lastModify;
+		old.lastChange = curNode->lastChange;
+		if (memcmp(&old, curNode, sizeof(INode)) != 0) refs[id].syncTxn = runningTxn;
+		else refs[id].attrTxn = runningTxn;
+	}
+	writeRange((off_t) id*sizeof(INode) + (off_t) superblock->firstINodeBlock*superblock->blockSize, 
+		curNode, sizeof(INode));
+}
+
+/**
+ * Notes that the running transaction changes where the data of the file 
+ * id lives, outside its INode as well: in an indirection block, the 
+ * share counts or the dedup index. fdatasync has to wait for that too.
+ */
+void noteMapChange(INodeID id) {
+	if (jcache != NULL) refs[id].syncTxn = runningTxn;
+}
+
+/***********************************************************************
+ * 
+ * Shared blocks
+ * 
+ * Clones share their data blocks until one of them writes. The share 
+ * counts live in SHARE_BLOCKS metadata blocks from shareStart, and are 
+ * changed under allocLock; markBlocksFree() takes an owner off a shared
+ * block instead of freeing it. The fingerprints of the dedup index are 
+ * kept the same way, see "Deduplication".
+ * 
+ ***********************************************************************/
+
+/**
+ * Records that some block has been shared or indexed, after which writes
+ * have to look before they write a block in place. Caller holds allocLock.
+ */
+void noteShared() {
+	if (superblock->state & SB_SHARED) return;
+	superblock->state |= SB_SHARED;
+	writeBlock(0, superblock);
+}
+
+/**
+ * Returns the number of owners blk has besides the first. Caller holds 
+ * allocLock, or see isShared().
+ */
+int getShares(BlockID blk) {
+	uint16_t count;
+	if (superblock->shareStart == 0) return 0;
+	readRange((off_t) superblock->shareStart * superblock->blockSize + blk * sizeof(uint16_t), 
+		&count, sizeof(count));
+	return count;
+}
+
+/**
+ * Sets the number of owners blk has besides the first. Caller holds 
+ * allocLock.
+ */
+void setShares(BlockID blk, int count) {
+	uint16_t value = count;
+	if (count > 0) noteShared();
+	writeRange((off_t) superblock->shareStart * superblock->blockSize + blk * sizeof(uint16_t), 
+		&value, sizeof(value));
+}
+
+/**
+ * Returns the fingerprint blk is in the dedup index under, or 0 if it 
+ * isn't. Caller holds allocLock, or see isShared().
+ */
+uint32_t getFingerprint(BlockID blk) {
+	uint32_t fp;
+	if (superblock->dedupStart == 0) return 0;
+	readRange((off_t) superblock->dedupStart * superblock->blockSize + blk * sizeof(uint32_t), 
+		&fp, sizeof(fp));
+	return fp;
+}
+
+/**
+ * Sets the fingerprint blk is in the dedup index under. Caller holds 
+ * allocLock.
+ */
+void setFingerprint(BlockID blk, uint32_t fp) {
+	if (fp != 0) noteShared();
+	writeRange((off_t) superblock->dedupStart * superblock->blockSize + blk * sizeof(uint32_t), 
+		&fp, sizeof(fp));
+}
+
+/**
+ * Returns whether the data block blk has more than one owner, or is in 
+ * the dedup index; either way it mustn't be written in place. Caller 
+ * holds the lock of a file blk is mapped in for writing. A block only 
+ * gains an owner through a clone, which holds that lock too, or through
+ * the index, which it's in already, so the answer can't turn true while
+ * the caller looks and allocLock isn't needed.
+ */
+bool isShared(BlockID blk) {
+	if (blk == 0 || isPacked(blk) || isCompressed(blk)) return false;
+	// nothing has ever been shared or indexed
+	if (!(superblock->state & SB_SHARED)) return false;
+	return getShares(blk) > 0 || getFingerprint(blk) != 0;
+}
+
+/**
+ * Sets SB_SHARED for an image last mounted before it was kept, if any 
+ * block there has a share count or a fingerprint.
+ */
+void findShared() {
+	BlockID starts[2] = { superblock->shareStart, superblock->dedupStart };
+	int counts[2] = { SHARE_BLOCKS, TOTAL_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE };
+	int i, j, k, n = superblock->blockSize / sizeof(uint32_t);
+	uint32_t *words = malloc(superblock->blockSize);
+	for (k=0; k<2 && !(superblock->state & SB_SHARED); k++) {
+		for (i=0; starts[k] != 0 && i<counts[k]; i++) {
+			readBlock(starts[k] + i, words);
+			for (j=0; j<n && words[j] == 0; j++);
+			if (j < n) {
+				superblock->state |= SB_SHARED;
+				break;
+			}
+		}
+	}
+	free(words);
+}
+
+/**
+ * Adds an owner to the data block blk. Returns 0, or -EMLINK if it has 
+ * as many as it can count.
+ */
+int shareBlock(BlockID blk) {
+	int res = 0;
+	pthread_mutex_lock(&allocLock);
+	if (getShares(blk) == SHARE_MAX) res = -EMLINK;
+	else setShares(blk, getShares(blk) + 1);
+	pthread_mutex_unlock(&allocLock);
+	return res;
+}
+
+/**
+ * Sets aside the share count blocks, for a new image or one made before 
+ * there were clones. Nothing is shared yet, so they start zeroed.
+ */
+void createShares() {
+	int i, blockSize = superblock->blockSize;
+	BlockID start;
+	char *zeroes;
+	
+	if ((start = reserveBlocks(SHARE_BLOCKS)) == 0) {
+		fprintf(stderr, "no room for share counts, running without clones\n");
+		return;
+	}
+	zeroes = calloc(blockSize, 1);
+	for (i=0; i<SHARE_BLOCKS; i++) {
+		pwrite(diskFd, zeroes, blockSize, (off_t) (start + i) * blockSize);
+	}
+	free(zeroes);
+	superblock->shareStart = start;
+	pwrite(diskFd, bitmap, blockSize, (off_t) superblock->bitmapBlock * blockSize);
+	pwrite(diskFd, superblock, blockSize, 0);
+	fdatasync(diskFd);
+}
+
+/***********************************************************************
+ * 
+ * Deduplication
+ * 
+ * Whole blocks written to a file created under -o dedup are looked up in
+ * the dedup index by fingerprint. One found to hold the same bytes is 
+ * shared rather than written again; otherwise the block written is added
+ * to the index. Freeing a block takes it out of the index, and a block in
+ * it is copied before it's written, so whatever the index points at still
+ * holds the bytes it was indexed with. The bytes are compared anyway, so 
+ * fingerprints that collide only cost a read.
+ * 
+ ***********************************************************************/
+
+/**
+ * Fingerprint of the contents of a block, hashed 8 bytes at a time in 
+ * four independent lanes, as xxHash does. Never 0.
+ */
+uint32_t fingerprint(const void *buf) {
+	const uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL;
+	uint64_t lanes[4] = { p1 + p2, p2, 0, -p1 }, word, hash;
+	uint32_t fp;
+	int i, n = superblock->blockSize / sizeof(word);
+	
+	for (i=0; i<n; i++) {
+		memcpy(&word, (const char *) buf + i * sizeof(word), sizeof(word));
+		lanes[i % 4] += word * p2;
+		lanes[i % 4] = (lanes[i % 4] << 31 | lanes[i % 4] >> 33) * p1;
+	}
+	hash = (lanes[0] << 1 | lanes[0] >> 63) + (lanes[1] << 7 | lanes[1] >> 57) + 
+		(lanes[2] << 12 | lanes[2] >> 52) + (lanes[3] << 18 | lanes[3] >> 46);
+	hash = (hash ^ hash >> 33) * p2;
+	hash ^= hash >> 29;
+	// 0 means a block isn't indexed, so the folded hash never is
+	fp = (uint32_t) (hash ^ hash >> 32);
+	return fp | (fp == 0);
+}
+
+/**
+ * Returns the block in the dedup bucket for fp, 0 for none. Caller holds
+ * allocLock.
+ */
+BlockID getBucket(uint32_t fp) {
+	BlockID blk;
+	readRange((off_t) superblock->dedupStart * superblock->blockSize + 
+		(TOTAL_BLOCKS + fp % DEDUP_BUCKETS) * sizeof(BlockID), &blk, sizeof(blk));
+	return blk;
+}
+
+/**
+ * Returns whether blk is still an indexed block with the fingerprint fp 
+ * that another owner can be added to. Caller holds allocLock.
+ */
+bool isIndexed(BlockID blk, uint32_t fp) {
+	return blk != 0 && (bitmap[blk / 8] & (1 << (blk % 8))) && getBucket(fp) == blk && 
+		getFingerprint(blk) == fp && getShares(blk) < SHARE_MAX;
+}
+
+/**
+ * Looks in the dedup index for a block holding exactly data, whose 
+ * fingerprint is fp, and adds an owner to it. Returns the block, or 0 if
+ * there is none, or it has as many owners as it can count. The block is
+ * compared without allocLock, then checked again under it, since it could
+ * have been freed in between.
+ */
+BlockID findDuplicate(uint32_t fp, const void *data) {
+	BlockID blk = 0;
+	char *blockBuf;
+	bool same;
+	if (superblock->dedupStart == 0) return 0;
+	pthread_mutex_lock(&allocLock);
+	blk = getBucket(fp);
+	if (!isIndexed(blk, fp)) blk = 0;
+	pthread_mutex_unlock(&allocLock);
+	if (blk == 0) return 0;
+	
+	blockBuf = malloc(superblock->blockSize);
+	readBlock(blk, blockBuf);
+	same = memcmp(blockBuf, data, superblock->blockSize) == 0;
+	free(blockBuf);
+	if (!same) return 0;
+	pthread_mutex_lock(&allocLock);
+	if (isIndexed(blk, fp)) setShares(blk, getShares(blk) + 1);
+	else blk = 0;
+	pthread_mutex_unlock(&allocLock);
+	return blk;
+}
+
+/**
+ * Adds blk, just written with contents whose fingerprint is fp, to the 
+ * dedup index, in place of whatever was in its bucket.
+ */
+void indexBlock(BlockID blk, uint32_t fp) {
+	if (superblock->dedupStart == 0) return;
+	pthread_mutex_lock(&allocLock);
+	setFingerprint(blk, fp);
+	writeRange((off_t) superblock->dedupStart * superblock->blockSize + 
+		(TOTAL_BLOCKS + fp % DEDUP_BUCKETS) * sizeof(BlockID), &blk, sizeof(blk));
+	pthread_mutex_unlock(&allocLock);
+}
+
+/**
+ * Sets aside the dedup index blocks, for a new image or one made before 
+ * there was deduplication. Nothing is indexed yet, so they start zeroed.
+ */
+void createDedup() {
+	int i, blockSize = superblock->blockSize;
+	BlockID start;
+	char *zeroes;
+	
+	if ((start = reserveBlocks(DEDUP_BLOCKS)) == 0) {
+		fprintf(stderr, "no room for the dedup index, running without it\n");
+		return;
+	}
+	zeroes = calloc(blockSize, 1);
+	for (i=0; i<DEDUP_BLOCKS; i++) {
+		pwrite(diskFd, zeroes, blockSize, (off_t) (start + i) * blockSize);
+	}
+	free(zeroes);
+	superblock->dedupStart = start;
+	pwrite(diskFd, bitmap, blockSize, (off_t) superblock->bitmapBlock * blockSize);
+	pwrite(diskFd, superblock, blockSize, 0);
+	fdatasync(diskFd);
+}
+
+/***********************************************************************
+ * 
+ * Allocation methods
+ * 
+ ***********************************************************************/
+
+/*
+ * markBlockUsed() and markINodeUsed() expect the caller to hold allocLock, 
+ * since they are only ever the second half of a search for a free entry. 
+ * The free methods take it themselves.
+ */
+
+void markBlockUsed(BlockID id) {
+	bitmap[id/8] |= 1 << (id % 8);
+	writeBlock(superblock->bitmapBlock, bitmap);
+	superblock->numFreeBlocks--;
+	superblock->regionFree[id / REGION_BLOCKS]--;
+	writeBlock(0, superblock);
+}
+
+/**
+ * Adds id to the blocks in list, to be freed later by markBlocksFree(),
+ * or punched out of the image by discardFreed().
+ */
+void addBlock(BlockList *list, BlockID id) {
+	if (list->count == list->size) {
+		list->size = (list->size == 0) ? 64 : list->size * 2;
+		list->ids = realloc(list->ids, list->size * sizeof(BlockID));
+	}
+	list->ids[list->count++] = id;
+}
+
+/**
+ * Frees the count blocks in ids, writing the bitmap and superblock out 
+ * once for all of them. They aren't used for file data again until the
+ * running transaction commits. Under -o discard, the blocks really freed are 
+ * queued to be punched out of the image once that's committed.
+ */
+void markBlocksFree(BlockID *ids, int count) {
+	int i, freed = 0, queued;
+	pthread_mutex_lock(&allocLock);
+	queued = discards.count;
+	for (i=0; i<count; i++) {
+		// don't allow anyone to mark INodes or superblock as unused
+		if (ids[i] < superblock->firstDataBlock) continue;
+		// a shared block only loses an owner
+		if (getShares(ids[i]) > 0) {
+			setShares(ids[i], getShares(ids[i]) - 1);
+			continue;
+		}
+		if (getFingerprint(ids[i]) != 0) setFingerprint(ids[i], 0);
+		bitmap[ids[i]/8] &= ~(1 << (ids[i] % 8));
+		superblock->regionFree[ids[i] / REGION_BLOCKS]++;
+		freed++;
+		freedTxn[ids[i]] = runningTxn;
+		lastFreedTxn = runningTxn;
+		if (discardBlocks) addBlock(&discards, ids[i]);
+	}
+	if (freed > 0) {
+		writeBlock(superblock->bitmapBlock, bitmap);
+		superblock->numFreeBlocks += freed;
+		writeBlock(0, superblock);
+	}
+	if (queued < DISCARD_BATCH && discards.count >= DISCARD_BATCH) pthread_cond_signal(&discardCond);
+	pthread_mutex_unlock(&allocLock);
+}
+
+void markINodeUsed(INodeID id) {
+	INode curNode;
+	readINode(id, &curNode);
+	curNode.flags = INODE_IN_USE;
+	writeINode(id, &curNode);
+	superblock->numFreeINodes--;
+	writeBlock(0, superblock);
+}
+
+void markINodeFree(INodeID id) {
+	INode curNode;
+	pthread_mutex_lock(&allocLock);
+	readINode(id, &curNode);
+	curNode.flags &= ~INODE_IN_USE;
+	writeINode(id, &curNode);
+	superblock->numFreeINodes++;
+	writeBlock(0, superblock);
+	pthread_mutex_unlock(&allocLock);
+}
+
+/**
+ * Counts the free blocks of each region, and of the disk, from the bitmap.
+ * Needed once for an image made before there were counts, and after a 
+ * crash on one without a journal to keep them in step with the bitmap.
+ */
+void buildSummary() {
+	int i;
+	memset(superblock->regionFree, 0, sizeof(superblock->regionFree));
+	superblock->numFreeBlocks = 0;
+	for (i=0; i<superblock->numBlocks; i++) {
+		if ((bitmap[i / 8] & (1 << (i % 8))) == 0) {
+			superblock->regionFree[i / REGION_BLOCKS]++;
+			superblock->numFreeBlocks++;
+		}
+	}
+	superblock->state |= SB_SUMMARY;
+	writeBlock(0, superblock);
+}
+
+/**
+ * Finds the next unused INode and allocates it, then returns the ID. curNode
+ * will contain the INode data upon exit.
+ */
+INodeID allocateNextINode() {
+	int i, n;
+	INode curNode;
+	pthread_mutex_lock(&allocLock);
+	// carry on from where the last search ended
+	for (n=0; n<superblock->numINodes && superblock->numFreeINodes > 0; n++) {
+		i = (superblock->inodeHint + n) % superblock->numINodes;
+		readINode(i, &curNode);
+		if (isFree((&curNode))) {
+			superblock->inodeHint = i + 1;
+			markINodeUsed(i);
+			pthread_mutex_unlock(&allocLock);
+			return i;
+		}
+	}
+	
+	pthread_mutex_unlock(&allocLock);
+	errno = ENOSPC;
+	return -1;
+}
+
+/**
+ * Finds the next free block on disk, and marks it as used in the bitmap.
+ * Then returns the block ID of the newly allocated block. Unless meta is
+ * set, blocks freed since the last commit are passed over, see "Journal".
+ */
+BlockID allocateBlock(bool meta) {
+	int i, n, r, end, regions = (superblock->numBlocks + REGION_BLOCKS - 1) / REGION_BLOCKS;
+	int start;
+	// metadata can have a block freed in the running transaction, but not
+	// one being punched out
+	uint32_t committed = TXN_DISCARDING - 1;
+	
+	pthread_mutex_lock(&allocLock);
+	if (!meta && jcache != NULL) {
+		pthread_mutex_lock(&journalLock);
+		committed = committedTxn;
+		pthread_mutex_unlock(&journalLock);
+	}
+	// carry on from the last allocation, coming back around to the start
+	// of its region at the end
+	start = superblock->blockHint % superblock->numBlocks;
+	for (n=0; n<=regions; n++) {
+		r = (start / REGION_BLOCKS + n) % regions;
+		if (superblock->regionFree[r] == 0) continue;
+		end = min((r + 1) * REGION_BLOCKS, superblock->numBlocks);
+		for (i = (n == 0) ? start : r * REGION_BLOCKS; i<end; i++) {
+			char b = bitmap[i / 8];
+			if ((b & (1 << (i % 8))) != 0 || freedTxn[i] > committed) continue;
+			// a block whose old image is still on its way from the journal 
+			// would be written over by it
+			if (!journalHas(i)) {
+				superblock->blockHint = i + 1;
+				markBlockUsed(i);
+				pthread_mutex_unlock(&allocLock);
+				return i;
+			}
+		}
+	}
+	
+	pthread_mutex_unlock(&allocLock);
+	errno = ENOSPC;
+	return -1;
+}
+
+/**
+ * Allocates a block for file data, see allocateBlock().
+ */
+BlockID allocateNextBlock() {
+	return allocateBlock(false);
+}
+
+/**
+ * Allocates a block that is only ever written through the journal: a 
+ * directory, indirection or tail block. See allocateBlock().
+ */
+BlockID allocateMetaBlock() {
+	return allocateBlock(true);
+}
+
+/**
+ * Finds room for count fragments in the tail block being filled, starting
+ * a new one if it has none. The old one fills no further; its fragments 
+ * come back as their files change. Returns the packed ID of the 
+ * fragments, or 0 with errno set.
+ */
+BlockID allocateFrags(int count) {
+	uint16_t mask;
+	int i, want = (1 << count) - 1;
+	BlockID blk;
+	
+	pthread_mutex_lock(&allocLock);
+	if ((blk = superblock->packBlock) != 0) {
+		readBlockPart(blk, &mask, 0, sizeof(mask));
+		for (i=1; i + count <= FRAGS_PER_BLOCK; i++) {
+			if ((mask & (want << i)) == 0) {
+				mask |= want << i;
+				writeBlockPart(blk, &mask, 0, sizeof(mask));
+				pthread_mutex_unlock(&allocLock);
+				return packID(blk, i, count);
+			}
+		}
+	}
+	pthread_mutex_unlock(&allocLock);
+	
+	blk = allocateMetaBlock();
+	if (blk == (BlockID) -1) return 0;
+	mask = want << 1;
+	writeBlockPart(blk, &mask, 0, sizeof(mask));
+	pthread_mutex_lock(&allocLock);
+	superblock->packBlock = blk;
+	writeBlock(0, superblock);
+	pthread_mutex_unlock(&allocLock);
+	return packID(blk, 1, count);
+}
+
+/**
+ * Gives back the fragments frag, freeing their tail block once it has
+ * none left in use.
+ */
+void freeFrags(BlockID frag) {
+	BlockID blk = packedBlock(frag);
+	uint16_t mask;
+	
+	pthread_mutex_lock(&allocLock);
+	readBlockPart(blk, &mask, 0, sizeof(mask));
+	mask &= ~(((1 << packedCount(frag)) - 1) << packedFrag(frag));
+	writeBlockPart(blk, &mask, 0, sizeof(mask));
+	if (mask == 0 && superblock->packBlock == blk) {
+		superblock->packBlock = 0;
+		writeBlock(0, superblock);
+	}
+	pthread_mutex_unlock(&allocLock);
+	if (mask == 0) markBlocksFree(&blk, 1);
+}
+
+int allocateNextHandle() {
+	int i;
+	pthread_mutex_lock(&handleLock);
+	for (i=0; i<NUM_OPEN_FILES; i++) {
+		if (handles[i].inUse == false) {
+			// if the handle is free, allocate it
+			handles[i].inUse = true;
+			pthread_mutex_unlock(&handleLock);
+			return i;
+		}
+	}
+	
+	pthread_mutex_unlock(&handleLock);
+	errno = ENFILE;
+	return -1;
+}
+
+void freeHandle(int fd) {
+	pthread_mutex_lock(&handleLock);
+	handles[fd].inUse = false;
+	pthread_mutex_unlock(&handleLock);
+}
+
+/***********************************************************************
+ * 
+ * Discard
+ * 
+ * The image is made TOTAL_SIZE long up front, and a block that's freed 
+ * keeps its space in the host file. Under -o discard, discarder punches
+ * freed blocks out of the image, a run of neighbours per fallocate(2),
+ * so it takes up only as much as the live data does. A block is only 
+ * punched once the transaction that freed it has committed, or a crash
+ * could bring it back with its bytes gone, and only while it's still 
+ * free. allocLock isn't held across the fallocate calls; the blocks are
+ * kept from the allocator by their freedTxn instead. sfs --sparsify does
+ * the same for every free block of an unmounted image.
+ * 
+ ***********************************************************************/
+
+/**
+ * Punches the count blocks from start out of the image, leaving a hole
+ * that reads as zeroes. Returns 0, or -errno.
+ */
+int punchBlocks(BlockID start, int count) {
+	int blockSize = superblock->blockSize;
+	if (fallocate(diskFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+			(off_t) start * blockSize, (off_t) count * blockSize) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+int compareBlocks(const void *a, const void *b) {
+	BlockID x = *(const BlockID *) a, y = *(const BlockID *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Punches out the queued blocks that are still free and whose freeing 
+ * has committed. Those freed in the running transaction stay queued, and 
+ * those handed out again since are dropped; they're queued again when 
+ * they're next freed. Caller holds allocLock, which is let go while the 
+ * blocks are punched.
+ */
+void discardFreed() {
+	BlockID *ids = discards.ids, *runs;
+	uint32_t committed;
+	int i, j, n = 0, count = 0, res = 0;
+	
+	if (discards.count == 0) return;
+	pthread_mutex_lock(&journalLock);
+	committed = (jcache == NULL) ? runningTxn : committedTxn;
+	pthread_mutex_unlock(&journalLock);
+	// without a journal the bitmap is only safe once it's on disk
+	if (jcache == NULL) fdatasync(diskFd);
+	qsort(ids, discards.count, sizeof(BlockID), compareBlocks);
+	// the blocks to punch leave the queue, which can grow meanwhile, and 
+	// can't be allocated until they're done
+	runs = malloc(discards.count * sizeof(BlockID));
+	for (i=0; i<discards.count; i++) {
+		if (i > 0 && ids[i] == ids[i - 1]) continue;
+		if (bitmap[ids[i] / 8] & (1 << (ids[i] % 8))) continue;
+		if (freedTxn[ids[i]] > committed) {
+			ids[n++] = ids[i];
+			continue;
+		}
+		freedTxn[ids[i]] = TXN_DISCARDING;
+		runs[count++] = ids[i];
+	}
+	discards.count = n;
+	pthread_mutex_unlock(&allocLock);
+	
+	// a run of neighbours at a time
+	for (i=0; i<count && res == 0; i += j) {
+		for (j=1; i + j < count && runs[i + j] == runs[i] + j; j++) {
+		}
+		if ((res = punchBlocks(runs[i], j)) == 0) discardedBlocks += j;
+	}
+	
+	pthread_mutex_lock(&allocLock);
+	for (i=0; i<count; i++) {
+		freedTxn[runs[i]] = 0;
+	}
+	free(runs);
+	if (res != 0) {
+		// the host filesystem can't punch holes, so stop trying
+		log_msg("\ndiscardFreed: %s, no longer discarding\n", strerror(-res));
+		discardBlocks = false;
+		discards.count = 0;
+	}
+}
+
+/**
+ * Punches out freed blocks every DISCARD_INTERVAL seconds, or sooner when
+ * DISCARD_BATCH of them are waiting. Runs in its own thread from init 
+ * until closeDisk(), under -o discard.
+ */
+void *discarder(void *arg) {
+	struct timespec wake;
+	pthread_mutex_lock(&allocLock);
+	while (!discardStopping) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += DISCARD_INTERVAL;
+		pthread_cond_timedwait(&discardCond, &allocLock, &wake);
+		if (discardBlocks) discardFreed();
+	}
+	pthread_mutex_unlock(&allocLock);
+	return NULL;
+}
+
+/**
+ * Starts discarder, under -o discard.
+ */
+void startDiscarder() {
+	if (!discardBlocks) return;
+	discardRunning = true;
+	discardStopping = false;
+	pthread_create(&discardThread, NULL, discarder, NULL);
+}
+
+/**
+ * Stops discarder, then punches out what's left. Called once the last 
+ * transaction has committed, so everything queued can go.
+ */
+void stopDiscarder() {
+	if (!discardRunning) return;
+	discardRunning = false;
+	pthread_mutex_lock(&allocLock);
+	discardStopping = true;
+	pthread_cond_signal(&discardCond);
+	pthread_mutex_unlock(&allocLock);
+	pthread_join(discardThread, NULL);
+	pthread_mutex_lock(&allocLock);
+	if (discardBlocks) discardFreed();
+	pthread_mutex_unlock(&allocLock);
+	free(discards.ids);
+}
+
+/**
+ * Punches every free block out of the unmounted image at path, so it 
+ * takes up only as much of the host as its live data. The image has to 
+ * have been unmounted cleanly. Returns an exit status.
+ */
+int sparsifyImage(const char *path) {
+	BlockID i, start = 0;
+	int count = 0, punched = 0, res = 0;
+	
+	if ((diskFd = open(path, O_RDWR)) < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	superblock = calloc(BLOCK_SIZE, 1);
+	bitmap = calloc(BLOCK_SIZE, 1);
+	pread(diskFd, superblock, BLOCK_SIZE, 0);
+	if (!validSuperBlock(superblock) || !(superblock->state & SB_CLEAN)) {
+		fprintf(stderr, "%s: not a cleanly unmounted sfs image, mount it first\n", path);
+		res = EXIT_FAILURE;
+		goto done;
+	}
+	readBlock(superblock->bitmapBlock, bitmap);
+	for (i=superblock->firstDataBlock; i<=superblock->numBlocks; i++) {
+		if (i < superblock->numBlocks && !(bitmap[i / 8] & (1 << (i % 8)))) {
+			if (count == 0) start = i;
+			count++;
+			continue;
+		}
+		if (count > 0 && (res = punchBlocks(start, count)) != 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(-res));
+			res = EXIT_FAILURE;
+			break;
+		}
+		punched += count;
+		count = 0;
+	}
+	if (res == 0) fdatasync(diskFd);
+	printf("%s: %d free blocks punched out\n", path, punched);
+done:
+	close(diskFd);
+	free(superblock);
+	free(bitmap);
+	return res;
+}
+
+/***********************************************************************
+ * 
+ * FileEntry methods
+ * 
+ ***********************************************************************/
+
+/**
+ * finds the file/directory specified by fname in dir. The BlockID pointer points
+ * to a location to store the block in which the entry is located, and the index 
+ * pointer points to a location to store the FileEntry's index in that block.
+ * 
+ * On success, returns the INodeID of the file/dir specified by fname, 
+ * or -1 with errno set if an error occurs
+ */
+INodeID findFileEntry(INodeID dir, const char *fname, BlockID *block, int *index) {
+	BlockID blk = 0;
+	int i, count, remaining, entriesPerBlock;
+	FileEntry *ptr;
+	FileEntry *entries;
+	INode curNode;
+	
+	readINode(dir, &curNode);
+	
+	if (!isDir((&curNode))) {
+		// ensure this is a directory
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	entries = malloc(superblock->blockSize);
+	remaining = curNode.childCount;
+	entriesPerBlock = superblock->blockSize / sizeof(FileEntry);
+	
+	// each iteration will read 1 block of data
+	while (remaining > 0) {
+		// read next block
+		readBlock(curNode.blocks[blk++], entries);
+		// read the remaining number of entries, or the whole blocks worth of entities
+		count = min(remaining, entriesPerBlock);
+		remaining -= count;
+		
+		for (i=0; i<count; i++) {
+			// iterate through each entry
+			ptr = &(entries[i]);
+			if (strcmp(ptr->value, fname) == 0) {
+				// found a match! 
+				int id = ptr->id;
+				free(entries);
+				*block = curNode.blocks[blk-1];
+				*index = i;
+				return id;
+			}
+		}
+	}
+	
+	free(entries);
+	errno = ENOENT;
+	return -1;
+}
+
+/**
+ * Adds the given child to the specified parent directory INode. Returns the 
+ * index the child was added at in the directory data blocks, or -1 if no
+ * space is left to add the child.
+ */
+int addFileEntry(INodeID dir, INodeID child, const char *fname) {
+	int childrenPerBlock = superblock->blockSize / sizeof(FileEntry);
+	int maxChildren = childrenPerBlock * 14;
+	INode curNode;
+	
+	readINode(dir, &curNode);
+	
+	if (curNode.childCount == maxChildren) {
+		errno = ENOSPC;
+		return -1;
+	}
+	// blk = which direct block this child will be in
+	// index = which FileEntry the child is in the block
+	int blk = curNode.childCount / childrenPerBlock;
+	int index = curNode.childCount % childrenPerBlock;
+	
+	if (curNode.blocks[blk] == 0) {
+		// if we are in an unallocated block
+		curNode.blocks[blk] = allocateMetaBlock();
+		if (curNode.blocks[blk] == (BlockID) -1) return -1;
+		curNode.size += superblock->blockSize;
+		curNode.blockCount++;
+	}
+	
+	FileEntry *block = malloc(superblock->blockSize);
+	readBlock(curNode.blocks[blk], block);
+	FileEntry *entry = &(block[index]);
+	// copy in name and ID
+	strcpy(entry->value, fname);
+	entry->id = child;
+	// write directory block back
+	writeBlock(curNode.blocks[blk], block);
+	curNode.childCount++;
+	// write INode back
+	writeINode(dir, &curNode);
+	free(block);
+	return curNode.childCount - 1;
+}
+
+/**
+ * Removes file specified by fname from the directory listing of dir, by
  * taking the last FileEntry element and putting it in place of the old entry
  */
-void removeFileEntry(INodeID dir, const char *fname) {
-	int childrenPerBlock = superblock->blockSize / sizeof(FileEntry);
-	// get block and index of fname
+void removeFileEntry(INodeID dir, const char *fname) {
+	int childrenPerBlock = superblock->blockSize / sizeof(FileEntry);
+	// get block and index of fname
+	int index;
+	BlockID block;
+	INode curNode;
+	INodeID fileID = findFileEntry(dir, fname, &block, &index);
+	// read dir to get child count
+	readINode(dir, &curNode);
+	if (fileID == (INodeID) -1) return;
+	BlockID lastBlk = curNode.blocks[(curNode.childCount - 1) / childrenPerBlock];
+	int lastIndex = (curNode.childCount - 1) % childrenPerBlock;
+	// check if it's the last element
+	if (block != lastBlk || index != lastIndex) {
+		// if we aren't deleting the last element, we have to copy the last element
+		// into the FileEntry of fname
+		FileEntry lastEntry;
+		FileEntry *entries = malloc(superblock->blockSize);
+		readBlock(lastBlk, entries);
+		// copy last entry
+		memcpy(&lastEntry, &(entries[lastIndex]), sizeof(FileEntry));
+		// read block containing fname
+		readBlock(block, entries);
+		// copy entry into proper index
+		memcpy(&(entries[index]), &lastEntry, sizeof(FileEntry));
+		writeBlock(block, entries);
+		free(entries);
+	}
+	
+	curNode.childCount--;
+	writeINode(dir, &curNode);
+	return;
+}
+
+
+/***********************************************************************
+ * 
+ * Directory navigation methods
+ * 
+ ***********************************************************************/
+
+int indexOf(const char *str, char val) {
+	int i = 0;
+	for (i=0; i<strlen(str); i++) {
+		if (str[i] == val) return i;
+	}
+	return -1;
+}
+
+int lastIndexOf(const char *str, char val) {
+	int i;
+	for (i=strlen(str)-1; i>=0; i--) {
+		if (str[i] == val) return i;
+	}
+	return -1;
+}
+
+/**
+ * Recursive function call to find file. Starting at the root directory, 
+ * it goes through each directory in a specified path, to find the INode of
+ * a specific file or directory. It does not care what the last INode represents,
+ * only that it exists.
+ * 
+ * Returns the INodeID of the file specified by path, or -1 if it, or a parent
+ * of it, does not exist.
+ */
+INodeID findFileInternal(INodeID dir, char *path);
+
+INodeID findFileInternal(INodeID dir, char *path) {
+	//log_msg("\nLOOKING FOR: %s IN %d\n", path, dir);
+	if (strlen(path) == 0) {
+		// if there is no length, return current directory
+		return dir;
+	}
+	
+	int br = indexOf(path, '/');
+	char *nextPath = path;
+	
+	if (br == -1) {
+		// on the last file!
+		nextPath = nextPath + strlen(nextPath);
+	} else {
+		// still in a directory, so we will need to search deeper
+		// set the '/' to \0 to end the string of the subdir to move to
+		nextPath[br] = 0;
+		// move nextPath up to exclude this subdir
+		nextPath = nextPath + br + 1;
+	}
+	
+	if (strlen(path) > 123) {
+		// ensure path length is okay
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	
+	BlockID blk;
+	INodeID id;
+	int index;
+	//log_msg("CUR: %s NEXT: %s\n\n", path, nextPath);
+	id = findFileEntry(dir, path, &blk, &index);
+	if (id == (INodeID) -1) return -1;
+	
+	return findFileInternal(id, nextPath);
+}
+
+
+/***********************************************************************
+ * 
+ * Lookup cache methods
+ * 
+ ***********************************************************************/
+
+/**
+ * Length of path as used for the lookup cache key, ignoring a trailing '/'
+ * so "/dir" and "/dir/" share an entry.
+ */
+int dcacheKeyLen(const char *path) {
+	int len = strlen(path);
+	if (len > 1 && path[len-1] == '/') len--;
+	return len;
+}
+
+int dcacheSlot(const char *path, int len) {
+	unsigned int hash = 5381;
+	int i;
+	for (i=0; i<len; i++) {
+		hash = hash * 33 + (unsigned char) path[i];
+	}
+	return hash % DCACHE_SIZE;
+}
+
+/**
+ * Returns the INodeID cached for path, or -1 if the path isn't cached.
+ */
+INodeID dcacheLookup(const char *path) {
+	int len = dcacheKeyLen(path);
+	INodeID id = -1;
+	DCacheEntry *entry = &(dcache[dcacheSlot(path, len)]);
+	
+	pthread_mutex_lock(&dcacheLock);
+	if (entry->path != NULL && strlen(entry->path) == len && 
+			strncmp(entry->path, path, len) == 0) {
+		id = entry->id;
+	}
+	pthread_mutex_unlock(&dcacheLock);
+	return id;
+}
+
+/**
+ * Caches the INode path resolved to, replacing whatever shared its slot.
+ */
+void dcacheInsert(const char *path, INodeID id) {
+	int len = dcacheKeyLen(path);
+	DCacheEntry *entry = &(dcache[dcacheSlot(path, len)]);
+	char *copy = malloc(len + 1);
+	memcpy(copy, path, len);
+	copy[len] = 0;
+	
+	pthread_mutex_lock(&dcacheLock);
+	free(entry->path);
+	entry->path = copy;
+	entry->id = id;
+	pthread_mutex_unlock(&dcacheLock);
+}
+
+/**
+ * Drops path from the cache. Must be called whenever path stops naming
+ * the INode it was cached with.
+ */
+void dcacheRemove(const char *path) {
+	int len = dcacheKeyLen(path);
+	DCacheEntry *entry = &(dcache[dcacheSlot(path, len)]);
+	
+	pthread_mutex_lock(&dcacheLock);
+	if (entry->path != NULL && strlen(entry->path) == len && 
+			strncmp(entry->path, path, len) == 0) {
+		free(entry->path);
+		entry->path = NULL;
+	}
+	pthread_mutex_unlock(&dcacheLock);
+}
+
+/**
+ * Empties the cache. Used when a directory moves, which changes the path of
+ * everything below it.
+ */
+void dcacheClear() {
+	int i;
+	pthread_mutex_lock(&dcacheLock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		free(dcache[i].path);
+		dcache[i].path = NULL;
+	}
+	pthread_mutex_unlock(&dcacheLock);
+}
+
+/**
+ * Actual function call, that uses findFileInternal
+ */
+INodeID findFile(const char *path) {
+	INodeID id = dcacheLookup(path);
+	if (id != (INodeID) -1) return id;
+	
+	// newPath always points to the start of the malloc()'ed space. PTR may change.
+	char *newPath = malloc(strlen(path)+1);
+	strcpy(newPath, path);
+	char *ptr = newPath;
+	
+	if (ptr[0] != '/') {
+		// need absolute path
+		free(newPath);
+		errno = EIO;
+		return -1;
+	} else {
+		// remove leading '/'
+		ptr += 1;
+	}
+	
+	if (ptr[strlen(ptr)-1] == '/') {
+		// remove trailing '/', as we do not care what the endpoint is
+		ptr[strlen(ptr)-1] = 0;
+	}
+	
+	id = findFileInternal(0, ptr);
+	free(newPath);
+	if (id != (INodeID) -1) dcacheInsert(path, id);
+	return id;
+}
+
+INodeID findParent(const char *path) {
+	char *newPath = malloc(strlen(path) + 1);
+	strcpy(newPath, path);
+	// 
+	int lastIndex = lastIndexOf(newPath, '/');
+	newPath[lastIndex+1] = 0;	// terminate parent path
+	// make sure parent exists
+	INodeID parent = findFile(newPath);
+	free(newPath);
+	return parent;
+}
+
+/**
+ * Returns a malloc()'ed copy of the last component of path, ignoring a
+ * trailing '/'.
+ */
+char *getFileName(const char *path) {
+	char *name, *copy;
+	int i;
+	copy = malloc(strlen(path) + 1);
+	strcpy(copy, path);
+	i = lastIndexOf(copy, '/');
+	if (i == strlen(copy) - 1) {
+		// remove ending slash
+		copy[i] = 0;
+		i = lastIndexOf(copy, '/');
+	}
+	
+	name = malloc(strlen(copy + i + 1) + 1);
+	strcpy(name, copy + i + 1);
+	free(copy);
+	return name;
+}
+
+/***********************************************************************
+ * 
+ * Compression
+ * 
+ * Clusters are compressed in the LZ4 block format: sequences of a token
+ * (literal count << 4 | match length - 4, each 15 meaning more bytes of
+ * it follow), the literals, and the match as a 2 byte offset back into 
+ * what was already produced. The last sequence is only literals. The
+ * codec is in lz4.c, and lz4test checks it.
+ * 
+ * Decompressed clusters are kept in a small cache, so that reading a 
+ * cluster a block at a time only decompresses it once.
+ * 
+ ***********************************************************************/
+
+/**
+ * Copies len bytes at pos of the cached cluster whose compressed bytes 
+ * start in blk into buffer. Returns false if it isn't cached.
+ */
+bool ccacheRead(BlockID blk, void *buffer, int pos, int len) {
+	CCacheEntry *entry = &(ccache[blk % CCACHE_SIZE]);
+	bool found;
+	pthread_mutex_lock(&ccacheLock);
+	found = entry->blk == blk;
+	if (found) memcpy(buffer, entry->data + pos, len);
+	pthread_mutex_unlock(&ccacheLock);
+	return found;
+}
+
+/**
+ * Caches data as the cluster whose compressed bytes start in blk.
+ */
+void ccachePut(BlockID blk, const void *data) {
+	CCacheEntry *entry = &(ccache[blk % CCACHE_SIZE]);
+	pthread_mutex_lock(&ccacheLock);
+	if (entry->data == NULL) entry->data = malloc(CLUSTER_BLOCKS * superblock->blockSize);
+	memcpy(entry->data, data, CLUSTER_BLOCKS * superblock->blockSize);
+	entry->blk = blk;
+	pthread_mutex_unlock(&ccacheLock);
+}
+
+/**
+ * Drops whatever is cached for blk. Must be called when a block of 
+ * compressed bytes is freed, before it can be reused.
+ */
+void ccacheDrop(BlockID blk) {
+	CCacheEntry *entry = &(ccache[blk % CCACHE_SIZE]);
+	pthread_mutex_lock(&ccacheLock);
+	if (entry->blk == blk) entry->blk = 0;
+	pthread_mutex_unlock(&ccacheLock);
+}
+
+/***********************************************************************
+ * 
+ * Block map methods
+ * 
+ * A file's blocks are found through blocks[0..11] directly, then through
+ * the single indirection block in blocks[12], then the double one in 
+ * blocks[13]. A 0 anywhere in the map is a hole, read as zeroes, and an 
+ * indirection block only exists while something below it is mapped.
+ * 
+ ***********************************************************************/
+
+/**
+ * This isn't tested
+ * 
+ * Gets the block ID that contains the specific offset of the file. 
+ * Returns 0 if no block is mapped there, which reads as a hole of zeroes.
+ */
+BlockID getBlockFromOffset(INode *node, int offset) {
+	int sizes[3];
+	int id, index;
+	int IDsPerBlock = superblock->blockSize / sizeof(BlockID);
+	BlockID *indirect;
+	// lists space (bytes) contained by each level of indirection
+	
+	sizes[0] = 12 * superblock->blockSize;
+	sizes[1] = IDsPerBlock * superblock->blockSize;
+	sizes[2] = IDsPerBlock * IDsPerBlock * superblock->blockSize;
+	
+	if (offset < sizes[0]) {
+		// divide by blocksize to get which blockID contains the offset
+        log_msg("\n trying to get %d which is %d\n", offset/superblock->blockSize, 
+                node->blocks[offset / superblock->blockSize]);
+		return node->blocks[offset / superblock->blockSize];
+	} else if ((offset -= sizes[0]) < sizes[1]) {
+		// inside of the single level indirection block
+		// read indirection block
+		if (node->blocks[12] == 0) return 0;
+		indirect = malloc(superblock->blockSize);
+		readBlock(node->blocks[12], indirect);
+	} else {
+		// otherwise, the block is inside the double indirection block
+		offset -= sizes[1];
+		if (node->blocks[13] == 0) return 0;
+		indirect = malloc(superblock->blockSize);
+		// divide by how much space each first-level indirection ID takes up
+		index = offset / (IDsPerBlock * superblock->blockSize);
+		readBlock(node->blocks[13], indirect);
+		id = indirect[index];
+		if (id == 0) {
+			free(indirect);
+			return 0;
+		}
+		readBlock(id, indirect);
+	}
+	
+	index = (offset / superblock->blockSize) % (IDsPerBlock); 
+	id = indirect[index];
+	if (id == 0) {
+		log_msg("\n returning 0 and index = %d \n", index);
+	}
+	free(indirect);
+	return id;
+}
+
+/**
+ * Reads the file block id from getBlockFromOffset() into buffer, which
+ * for a hole (0) means filling it with zeroes, and for a packed tail 
+ * reading just its fragments.
+ */
+void readFileBlock(BlockID id, void *buffer) {
+	if (id == 0) {
+		memset(buffer, 0, superblock->blockSize);
+	} else if (isPacked(id)) {
+		memset(buffer, 0, superblock->blockSize);
+		readBlockPart(packedBlock(id), buffer, packedFrag(id) * FRAG_SIZE, packedCount(id) * FRAG_SIZE);
+	} else {
+		readBlock(id, buffer);
+	}
+}
+
+/**
+ * Allocates an indirection block full of holes. Returns its ID, or -1.
+ */
+BlockID allocateIndirect() {
+	BlockID blk = allocateMetaBlock();
+	if (blk == (BlockID) -1) return -1;
+	BlockID *ids = calloc(superblock->blockSize, 1);
+	writeBlock(blk, ids);
+	free(ids);
+	return blk;
+}
+
+/**
+ * Returns how many whole blocks the map entry blk holds: none for a hole,
+ * a packed tail or a block of a compressed cluster past its bytes.
+ */
+int mappedBlocks(BlockID blk) {
+	if (blk == 0 || isPacked(blk)) return 0;
+	if (isCompressed(blk)) return compressedBlock(blk) != 0;
+	return 1;
+}
+
+/**
+ * Maps blk, or a newly allocated block if blk is 0, at block index in the
+ * file id, allocating whatever indirection blocks lead to it. Whatever 
+ * blk replaces is left to the caller. curNode is the file's INode, and is
+ * kept up to date. Returns the block ID, or -1 with errno set. A new 
+ * block's old contents are left as they were.
+ */
+BlockID mapBlock(INodeID id, INode *curNode, int index, BlockID blk) {
+	int level, added = 0, top = 0, err, ipb = superblock->blockSize / sizeof(BlockID);
+	BlockID next, parent = 0, topParent = 0, fresh[2], *slot, *ids;
+	
+	// find the slot in the INode that index is reached through, and how
+	// many levels of indirection are below it
+	if (index < 12) {
+		slot = &(curNode->blocks[index]);
+		level = 0;
+	} else if ((index -= 12) < ipb) {
+		slot = &(curNode->blocks[12]);
+		level = 1;
+	} else if ((index -= ipb) < ipb * ipb) {
+		slot = &(curNode->blocks[13]);
+		level = 2;
+	} else {
+		errno = EFBIG;
+		return -1;
+	}
+	
+	ids = malloc(superblock->blockSize);
+	for (;; level--) {
+		if (*slot == 0 || (level == 0 && blk != 0)) {
+			if (level > 0) next = allocateIndirect();
+			else next = (blk != 0) ? blk : allocateNextBlock();
+			if (next == (BlockID) -1) {
+				// indirection blocks allocated on the way lead to nothing, 
+				// so they go again
+				err = errno;
+				if (added > 0) {
+					if (topParent == 0) {
+						curNode->blocks[top] = 0;
+					} else {
+						readBlock(topParent, ids);
+						ids[top] = 0;
+						writeBlock(topParent, ids);
+					}
+					curNode->blockCount -= added;
+					writeINode(id, curNode);
+					markBlocksFree(fresh, added);
+				}
+				free(ids);
+				errno = err;
+				return -1;
+			}
+			if (level > 0) {
+				if (added == 0) {
+					topParent = parent;
+					top = (parent == 0) ? slot - curNode->blocks : slot - ids;
+				}
+				fresh[added++] = next;
+			}
+			curNode->blockCount += mappedBlocks(next) - mappedBlocks(*slot);
+			*slot = next;
+			noteMapChange(id);
+			// parent 0 means the slot is in the INode. The INode's count 
+			// of blocks changes either way
+			if (parent != 0) writeBlock(parent, ids);
+			writeINode(id, curNode);
+		}
+		if (level == 0) break;
+		parent = *slot;
+		readBlock(parent, ids);
+		slot = &(ids[(level == 2) ? index / ipb : index % ipb]);
+	}
+	blk = *slot;
+	free(ids);
+	return blk;
+}
+
+/**
+ * Gives the file id a block of its own in place of the shared block *blk
+ * at block index, and sets *blk to it. The old contents are copied over 
+ * if copy is set. Returns 0, or -errno.
+ */
+int unshareBlock(INodeID id, INode *curNode, int index, BlockID *blk, bool copy) {
+	BlockID old = *blk, own = allocateNextBlock();
+	if (own == (BlockID) -1) return -errno;
+	if (copy) {
+		char *blockBuf = malloc(superblock->blockSize);
+		readBlock(old, blockBuf);
+		writeFileBlock(own, blockBuf);
+		free(blockBuf);
+	}
+	mapBlock(id, curNode, index, own);
+	markBlocksFree(&old, 1);
+	*blk = own;
+	return 0;
+}
+
+/**
+ * Unmaps every block in the range [first, end) of the tree under *slot, 
+ * which has levels of indirection and starts at block index base, adding
+ * them to freed. Indirection blocks left empty go too; only the ones that
+ * keep some entries are written back, and data blocks are never read.
+ * Returns true if *slot changed, so the caller has to write out whatever
+ * holds it.
+ */
+bool unmapTree(BlockID *slot, int levels, int base, int first, int end, BlockList *freed) {
+	int i, span = 1, ipb = superblock->blockSize / sizeof(BlockID);
+	bool changed = false, empty = true;
+	BlockID *ids;
+	
+	for (i=0; i<levels; i++) span *= ipb;
+	if (*slot == 0 || end <= base || first >= base + span) return false;
+	if (levels > 0) {
+		ids = malloc(superblock->blockSize);
+		readBlock(*slot, ids);
+		span /= ipb;
+		for (i=0; i<ipb; i++) {
+			if (levels == 1) {
+				// leaves are handled here rather than by a call per entry
+				if (ids[i] != 0 && base + i >= first && base + i < end) {
+					addBlock(freed, ids[i]);
+					ids[i] = 0;
+					changed = true;
+				}
+			} else if (unmapTree(&(ids[i]), levels - 1, base + i * span, first, end, freed)) {
+				changed = true;
+			}
+			if (ids[i] != 0) empty = false;
+		}
+		if (!empty && changed) writeBlock(*slot, ids);
+		free(ids);
+		if (!empty) return false;
+	}
+	addBlock(freed, *slot);
+	*slot = 0;
+	return true;
+}
+
+/**
+ * Frees the blocks in freed, as taken out of a file's map, and the list 
+ * itself. A packed tail gives back fragments rather than a block, and a 
+ * compressed one the block of compressed bytes it stands for, if any.
+ */
+void freeMapped(BlockList *freed) {
+	int i, n;
+	BlockID blk;
+	for (i=0, n=0; i<freed->count; i++) {
+		blk = freed->ids[i];
+		if (isPacked(blk)) {
+			freeFrags(blk);
+		} else if (isCompressed(blk)) {
+			if (compressedBlock(blk) == 0) continue;
+			ccacheDrop(compressedBlock(blk));
+			freed->ids[n++] = compressedBlock(blk);
+		} else {
+			freed->ids[n++] = blk;
+		}
+	}
+	markBlocksFree(freed->ids, n);
+	free(freed->ids);
+}
+
+/**
+ * Unmaps and frees the blocks of the file id in the range [first, end),
+ * leaving holes. curNode is the file's INode, and is written back before
+ * the blocks are marked free, all in a single bitmap update.
+ */
+void unmapBlocks(INodeID id, INode *curNode, int first, int end) {
+	int i, ipb = superblock->blockSize / sizeof(BlockID);
+	BlockList freed = { NULL, 0, 0 };
+	for (i=first; i<12 && i<end; i++) {
+		if (curNode->blocks[i] == 0) continue;
+		addBlock(&freed, curNode->blocks[i]);
+		curNode->blocks[i] = 0;
+	}
+	unmapTree(&(curNode->blocks[12]), 1, 12, first, end, &freed);
+	unmapTree(&(curNode->blocks[13]), 2, 12 + ipb, first, end, &freed);
+	for (i=0; i<freed.count; i++) curNode->blockCount -= mappedBlocks(freed.ids[i]);
+	if (freed.count > 0) noteMapChange(id);
+	writeINode(id, curNode);
+	freeMapped(&freed);
+}
+
+/***********************************************************************
+ * 
+ * Inline data
+ * 
+ * A new file keeps its bytes in the blocks[] array of its INode, so that
+ * tiny files take no blocks and are read with the INode itself. Bytes 
+ * past the size are kept zeroed. Once the file outgrows INLINE_SIZE, or 
+ * something needs it to have real blocks, its bytes move to a block and 
+ * it's mapped like any other file from then on.
+ * 
+ * blocks[] is all the room an INode has, and INodes are packed into the
+ * INode blocks at a fixed size, so INLINE_SIZE is only 56 bytes. A file 
+ * a little bigger, such as a 100 byte config file, doesn't get a block 
+ * to itself for long either: once it goes quiet its tail is packed into
+ * fragments, see "Tail packing", and it takes FRAG_SIZE bytes of a tail 
+ * block shared with other files.
+ * 
+ ***********************************************************************/
+
+/**
+ * Moves the bytes of the inline file id, with the INode curNode, into a 
+ * newly allocated block 0. Returns 0, or -errno with the file unchanged.
+ */
+int uninlineFile(INodeID id, INode *curNode) {
+	BlockID blk = 0;
+	if (curNode->size > 0) {
+		char *blockBuf = calloc(superblock->blockSize, 1);
+		memcpy(blockBuf, curNode->blocks, curNode->size);
+		blk = allocateNextBlock();
+		// the block has the bytes before the INode points at it
+		if (blk != (BlockID) -1) writeFileBlock(blk, blockBuf);
+		free(blockBuf);
+		if (blk == (BlockID) -1) return -errno;
+	}
+	memset(curNode->blocks, 0, sizeof(curNode->blocks));
+	curNode->blocks[0] = blk;
+	curNode->blockCount = (blk != 0);
+	curNode->flags &= ~INODE_INLINE;
+	writeINode(id, curNode);
+	return 0;
+}
+
+/**
+ * Zeroes the inline bytes of curNode from start to end.
+ */
+void zeroInline(INode *curNode, off_t start, off_t end) {
+	if (start < end) memset((char *) curNode->blocks + start, 0, end - start);
+}
+
+/***********************************************************************
+ * 
+ * Tail packing
+ * 
+ * Once a file has gone PACK_DELAY seconds without a handle that wrote to
+ * it being released, tailFlusher moves its last partial block into 
+ * fragments of a tail block shared with other files, if it fits in fewer
+ * than FRAGS_PER_BLOCK of them. Waiting means a file appended to by one
+ * open after another isn't packed and unpacked each time. Readers take 
+ * the fragments as they are. Anything that changes the file's blocks 
+ * unpacks the tail into a block of its own first.
+ * 
+ ***********************************************************************/
+
+/**
+ * Packs the last block of the file id into fragments, if it's partial and
+ * small enough. Caller holds the INode's lock for writing.
+ */
+void packTail(INodeID id) {
+	INode curNode;
+	BlockID blk, frag;
+	int index, len, count, blockSize = superblock->blockSize;
+	
+	readINode(id, &curNode);
+	len = curNode.size % blockSize;
+	if (!isFile((&curNode)) || isInline((&curNode)) || len == 0) return;
+	count = (len + FRAG_SIZE - 1) / FRAG_SIZE;
+	if (count >= FRAGS_PER_BLOCK) return;
+	index = curNode.size / blockSize;
+	blk = getBlockFromOffset(&curNode, index * blockSize);
+	if (blk == 0 || isPacked(blk)) return;
+	if ((frag = allocateFrags(count)) == 0) return;
+	
+	// the fragments are written before anything points at them
+	char *blockBuf = malloc(blockSize);
+	readBlock(blk, blockBuf);
+	memset(blockBuf + len, 0, count * FRAG_SIZE - len);
+	writeBlockPart(packedBlock(frag), blockBuf, packedFrag(frag) * FRAG_SIZE, count * FRAG_SIZE);
+	free(blockBuf);
+	mapBlock(id, &curNode, index, frag);
+	markBlocksFree(&blk, 1);
+}
+
+/**
+ * Queues the tail of the file id to be packed PACK_DELAY seconds from now,
+ * or later if a writer releases it again before then. If too many files 
+ * are waiting already it's packed now. Caller holds the INode's lock for
+ * writing.
+ */
+void queuePack(INodeID id) {
+	bool queued = true;
+	pthread_mutex_lock(&tailLock);
+	if (refs[id].packAfter == 0) {
+		if (packCount < NUM_PACKS) packs[packCount++] = id;
+		else queued = false;
+	}
+	if (queued) refs[id].packAfter = time(NULL) + PACK_DELAY;
+	pthread_mutex_unlock(&tailLock);
+	if (!queued) packTail(id);
+}
+
+/**
+ * Packs the tails of the queued files whose time has come, or of all of 
+ * them if all is set. Caller holds tailLock, which is let go while each
+ * file is packed.
+ */
+void packQueued(bool all) {
+	time_t now = time(NULL);
+	INodeID id;
+	int i;
+	for (i=0; i<packCount; ) {
+		id = packs[i];
+		if (!all && refs[id].packAfter > now) {
+			i++;
+			continue;
+		}
+		// only this takes files off the queue, so i stays where it is
+		packs[i] = packs[--packCount];
+		refs[id].packAfter = 0;
+		// tailLock comes after the INode locks
+		pthread_mutex_unlock(&tailLock);
+		beginOp();
+		lockINode(id, true);
+		// a file being appended to again waits for its next release
+		if (refs[id].tail == 0) packTail(id);
+		unlockINode(id);
+		endOp();
+		pthread_mutex_lock(&tailLock);
+	}
+}
+
+/**
+ * Moves a packed tail of the file id, with the INode curNode, back into a
+ * block of its own. Returns 0, or -errno with the file unchanged.
+ */
+int unpackTail(INodeID id, INode *curNode) {
+	BlockID blk, frag;
+	int index, blockSize = superblock->blockSize;
+	
+	if (isInline(curNode) || curNode->size % blockSize == 0) return 0;
+	index = curNode->size / blockSize;
+	frag = getBlockFromOffset(curNode, index * blockSize);
+	if (!isPacked(frag)) return 0;
+	if ((blk = allocateNextBlock()) == (BlockID) -1) return -errno;
+	
+	char *blockBuf = malloc(blockSize);
+	readFileBlock(frag, blockBuf);
+	writeFileBlock(blk, blockBuf);
+	free(blockBuf);
+	mapBlock(id, curNode, index, blk);
+	freeFrags(frag);
+	return 0;
+}
+
+/***********************************************************************
+ * 
+ * Compressed clusters
+ * 
+ * A compressed file writes a whole cluster at a time through packCluster(),
+ * which keeps it compressed if that saves a block, and writeCluster() 
+ * otherwise. A cluster is only ever changed whole: anything that writes
+ * part of a compressed cluster, or unmaps part of one, expands it into 
+ * plain blocks first. Readers decompress through the cluster cache.
+ * 
+ ***********************************************************************/
+
+/**
+ * Fills ids with the map entries of the blocks of cluster c of curNode.
+ */
+void getCluster(INode *curNode, int c, BlockID *ids) {
+	int i, blockSize = superblock->blockSize;
+	for (i=0; i<CLUSTER_BLOCKS; i++) {
+		ids[i] = getBlockFromOffset(curNode, (c * CLUSTER_BLOCKS + i) * blockSize);
+	}
+}
+
+/**
+ * Returns whether ids, the map entries of a cluster, are all holes.
+ */
+bool clusterIsHole(const BlockID *ids) {
+	int i;
+	for (i=0; i<CLUSTER_BLOCKS; i++) {
+		if (ids[i] != 0) return false;
+	}
+	return true;
+}
+
+/**
+ * Reads cluster c of curNode, compressed or not, into data. Returns 0, or
+ * -EIO if its compressed bytes are damaged.
+ */
+int readCluster(INode *curNode, int c, char *data) {
+	BlockID ids[CLUSTER_BLOCKS];
+	uint32_t len;
+	int i, n, blockSize = superblock->blockSize, size = CLUSTER_BLOCKS * blockSize;
+	
+	getCluster(curNode, c, ids);
+	if (!isCompressed(ids[0])) {
+		for (i=0; i<CLUSTER_BLOCKS; i++) readFileBlock(ids[i], data + i * blockSize);
+		return 0;
+	}
+	if (ccacheRead(compressedBlock(ids[0]), data, 0, size)) return 0;
+	char *packed = malloc(size);
+	for (i=0; i<CLUSTER_BLOCKS && compressedBlock(ids[i]) != 0; i++) {
+		readBlock(compressedBlock(ids[i]), packed + i * blockSize);
+	}
+	memcpy(&len, packed, sizeof(len));
+	n = (len > i * blockSize - sizeof(len)) ? -1 : 
+		lz4Decompress(packed + sizeof(len), len, data, size);
+	free(packed);
+	if (n < 0) {
+		log_msg("\nreadCluster: cluster at block %d doesn't decompress\n", compressedBlock(ids[0]));
+		return -EIO;
+	}
+	memset(data + n, 0, size - n);
+	ccachePut(compressedBlock(ids[0]), data);
+	return 0;
+}
+
+/**
+ * Reads the block at offset of curNode, which getBlockFromOffset() gave 
+ * as id, into buffer. Like readFileBlock(), but a block of a compressed 
+ * cluster is found in the decompressed cluster; a damaged one reads as 
+ * zeroes.
+ */
+void readDataBlock(INode *curNode, off_t offset, BlockID id, void *buffer) {
+	int blockSize = superblock->blockSize, size = CLUSTER_BLOCKS * blockSize;
+	int pos = offset % size / blockSize * blockSize;
+	if (!isCompressed(id)) {
+		readFileBlock(id, buffer);
+		return;
+	}
+	BlockID first = getBlockFromOffset(curNode, offset - offset % size);
+	if (ccacheRead(compressedBlock(first), buffer, pos, blockSize)) return;
+	char *data = malloc(size);
+	if (readCluster(curNode, offset / size, data) == 0) memcpy(buffer, data + pos, blockSize);
+	else memset(buffer, 0, blockSize);
+	free(data);
+}
+
+/**
+ * Maps ids, none of them 0, in place of old as cluster c of the file id, 
+ * and frees whichever of old are no longer mapped. On failure, the rest 
+ * of ids are freed instead. Returns 0, or -errno.
+ */
+int remapCluster(INodeID id, INode *curNode, int c, BlockID *old, BlockID *ids) {
+	BlockList freed = { NULL, 0, 0 };
+	int i, res = 0;
+	for (i=0; i<CLUSTER_BLOCKS; i++) {
+		if (ids[i] == old[i]) continue;
+		// a cluster is never split between indirection blocks, so only 
+		// the first can fail
+		if (res == 0 && mapBlock(id, curNode, c * CLUSTER_BLOCKS + i, ids[i]) == (BlockID) -1) {
+			res = -errno;
+		}
+		if (res != 0) addBlock(&freed, ids[i]);
+		else if (old[i] != 0) addBlock(&freed, old[i]);
+	}
+	freeMapped(&freed);
+	return res;
+}
+
+/**
+ * Writes data, a whole cluster, as cluster c of the file id compressed, 
+ * if that takes fewer blocks. Returns 0, 1 if it doesn't compress well 
+ * enough (leaving the file as it was), or -errno.
+ */
+int packCluster(INodeID id, INode *curNode, int c, char *data) {
+	BlockID old[CLUSTER_BLOCKS], ids[CLUSTER_BLOCKS];
+	uint32_t len;
+	int i, k, res, blockSize = superblock->blockSize, size = CLUSTER_BLOCKS * blockSize;
+	
+	char *packed = malloc(size);
+	len = lz4Compress(data, size, packed + sizeof(len), size - blockSize - sizeof(len));
+	if (len == 0) {
+		free(packed);
+		__sync_fetch_and_add(&rawClusters, 1);
+		return 1;
+	}
+	memcpy(packed, &len, sizeof(len));
+	k = (len + sizeof(len) + blockSize - 1) / blockSize;
+	memset(packed + sizeof(len) + len, 0, k * blockSize - sizeof(len) - len);
+	
+	// the compressed bytes are written before anything points at them
+	for (i=0; i<CLUSTER_BLOCKS; i++) ids[i] = BLOCK_COMPRESSED;
+	for (i=0; i<k; i++) {
+		BlockID blk = allocateNextBlock();
+		if (blk == (BlockID) -1) {
+			res = -errno;
+			for (k=0; k<i; k++) ids[k] = compressedBlock(ids[k]);
+			markBlocksFree(ids, i);
+			free(packed);
+			return res;
+		}
+		writeFileBlock(blk, packed + i * blockSize);
+		ids[i] |= blk;
+	}
+	free(packed);
+	getCluster(curNode, c, old);
+	if ((res = remapCluster(id, curNode, c, old, ids)) != 0) return res;
+	ccachePut(compressedBlock(ids[0]), data);
+	__sync_fetch_and_add(&packedClusters, 1);
+	return 0;
+}
+
+/**
+ * Writes data, a whole cluster, as cluster c of the file id uncompressed.
+ * Plain blocks of its own are written in place; a compressed cluster, 
+ * holes and shared blocks get new ones. Returns 0, or -errno with the 
+ * file as it was.
+ */
+int writeCluster(INodeID id, INode *curNode, int c, char *data) {
+	BlockID old[CLUSTER_BLOCKS], ids[CLUSTER_BLOCKS];
+	int i, j, res, blockSize = superblock->blockSize;
+	
+	getCluster(curNode, c, old);
+	for (i=0; i<CLUSTER_BLOCKS; i++) {
+		if (old[i] != 0 && !isCompressed(old[i]) && !isShared(old[i])) {
+			ids[i] = old[i];
+		} else if ((ids[i] = allocateNextBlock()) == (BlockID) -1) {
+			res = -errno;
+			for (j=0; j<i; j++) {
+				if (ids[j] != old[j]) markBlocksFree(&(ids[j]), 1);
+			}
+			return res;
+		}
+		writeFileBlock(ids[i], data + i * blockSize);
+	}
+	return remapCluster(id, curNode, c, old, ids);
+}
+
+/**
+ * Turns cluster c of the file id, if it's compressed, into plain blocks.
+ * Returns 0, or -errno.
+ */
+int expandCluster(INodeID id, INode *curNode, int c) {
+	int res, size = CLUSTER_BLOCKS * superblock->blockSize;
+	if (!isCompressed(getBlockFromOffset(curNode, c * size))) return 0;
+	char *data = malloc(size);
+	res = readCluster(curNode, c, data);
+	if (res == 0) res = writeCluster(id, curNode, c, data);
+	free(data);
+	return res;
+}
+
+/**
+ * Expands the compressed clusters that the block range [first, end) of 
+ * the file id only partly covers, so the range can be unmapped by itself.
+ * Returns 0, or -errno.
+ */
+int breakClusters(INodeID id, INode *curNode, int first, int end) {
+	int res;
+	if (first % CLUSTER_BLOCKS != 0 && 
+			(res = expandCluster(id, curNode, first / CLUSTER_BLOCKS)) != 0) {
+		return res;
+	}
+	if (end != INT_MAX && end % CLUSTER_BLOCKS != 0) {
+		return expandCluster(id, curNode, end / CLUSTER_BLOCKS);
+	}
+	return 0;
+}
+
+/**
+ * Maps ids, the compressed cluster of another file, as cluster c of the 
+ * file id, adding an owner to each block of compressed bytes. Whatever 
+ * was mapped there is left to the caller. Returns 0, or -errno with 
+ * nothing shared.
+ */
+int shareCluster(INodeID id, INode *curNode, int c, BlockID *ids) {
+	int i, j, res = 0;
+	for (i=0; i<CLUSTER_BLOCKS && compressedBlock(ids[i]) != 0; i++) {
+		if ((res = shareBlock(compressedBlock(ids[i]))) != 0) break;
+	}
+	for (j=0; j<CLUSTER_BLOCKS && res == 0; j++) {
+		if (mapBlock(id, curNode, c * CLUSTER_BLOCKS + j, ids[j]) == (BlockID) -1) res = -errno;
+	}
+	if (res != 0) {
+		// only the first mapBlock() can fail, so nothing was mapped
+		for (j=0; j<i; j++) {
+			BlockID blk = compressedBlock(ids[j]);
+			markBlocksFree(&blk, 1);
+		}
+	}
+	return res;
+}
+
+/***********************************************************************
+ * 
+ * Orphans
+ * 
+ * An unlinked file that's too big to free on the spot is put on the 
+ * orphan list in the superblock, which orphanReaper() works through from 
+ * the head, a batch of blocks at a time. The list is on disk, so whatever
+ * is left on it at unmount or a crash is picked up on the next mount.
+ * 
+ ***********************************************************************/
+
+/**
+ * Puts the file id, with the INode curNode, at the head of the orphan 
+ * list. Caller holds the INode's lock for writing.
+ */
+void queueOrphan(INodeID id, INode *curNode) {
+	pthread_mutex_lock(&allocLock);
+	curNode->flags |= INODE_ORPHAN;
+	curNode->childCount = superblock->orphanHead;
+	writeINode(id, curNode);
+	superblock->orphanHead = id;
+	writeBlock(0, superblock);
+	pthread_cond_signal(&orphanCond);
+	pthread_mutex_unlock(&allocLock);
+}
+
+/**
+ * Takes the orphan id, whose successor is next, off the orphan list, then
+ * marks its INode free. Unlinking comes first, so a crash in between 
+ * leaks the INode rather than losing the rest of the list.
+ */
+void dropOrphan(INodeID id, INodeID next) {
+	INode curNode;
+	INodeID prev;
+	pthread_mutex_lock(&allocLock);
+	if (superblock->orphanHead == id) {
+		superblock->orphanHead = next;
+		writeBlock(0, superblock);
+	} else {
+		// others were queued in front of it since it was picked up
+		for (prev = superblock->orphanHead; prev != 0; prev = curNode.childCount) {
+			readINode(prev, &curNode);
+			if (curNode.childCount == id) {
+				curNode.childCount = next;
+				writeINode(prev, &curNode);
+				break;
+			}
+		}
+	}
+	memset(&curNode, 0, sizeof(INode));
+	writeINode(id, &curNode);
+	superblock->numFreeINodes++;
+	writeBlock(0, superblock);
+	pthread_mutex_unlock(&allocLock);
+}
+
+/**
+ * Frees the blocks of orphans, from the end of the file back, ORPHAN_BATCH
+ * at a time, letting go of the INode's lock in between. The size goes 
+ * down with each batch, so work interrupted by a crash carries on from 
+ * there. Runs in its own thread from init until closeDisk().
+ */
+void *orphanReaper(void *arg) {
+	INode curNode;
+	INodeID id;
+	int first, blockSize = superblock->blockSize;
+	pthread_mutex_lock(&allocLock);
+	while (!reaperStopping) {
+		id = superblock->orphanHead;
+		if (id == 0) {
+			pthread_cond_wait(&orphanCond, &allocLock);
+			continue;
+		}
+		// allocLock comes after the INode locks
+		pthread_mutex_unlock(&allocLock);
+		beginBulkOp();
+		lockINode(id, true);
+		readINode(id, &curNode);
+		if (curNode.size > 0) {
+			first = max(0, (curNode.size - 1) / blockSize + 1 - ORPHAN_BATCH);
+			curNode.size = first * blockSize;
+			unmapBlocks(id, &curNode, first, INT_MAX);
+		} else {
+			// preallocated blocks past the end are all that can be left
+			unmapBlocks(id, &curNode, 0, INT_MAX);
+			dropOrphan(id, curNode.childCount);
+		}
+		unlockINode(id);
+		endOp();
+		pthread_mutex_lock(&allocLock);
+	}
+	pthread_mutex_unlock(&allocLock);
+	return NULL;
+}
+
+/**
+ * Starts orphanReaper, which begins with whatever orphans the last mount
+ * left behind.
+ */
+void startReaper() {
+	reaperStopping = false;
+	pthread_create(&reaperThread, NULL, orphanReaper, NULL);
+}
+
+/**
+ * Stops orphanReaper. Orphans it didn't get to stay on the list.
+ */
+void stopReaper() {
+	pthread_mutex_lock(&allocLock);
+	reaperStopping = true;
+	pthread_cond_signal(&orphanCond);
+	pthread_mutex_unlock(&allocLock);
+	pthread_join(reaperThread, NULL);
+}
+
+/***********************************************************************
+ * 
+ * File allocation methods
+ * 
+ ***********************************************************************/
+
+INodeID allocateFile(bool isDir) {
+	INode curNode;
+	INodeID id = allocateNextINode();
+	if (id == (INodeID) -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	
+	// a directory starts with a block for its entries; a file starts 
+	// inline, with no blocks
+	BlockID blk = 0;
+	if (isDir && (blk = allocateMetaBlock()) == (BlockID) -1) {
+		markINodeFree(id);
+		errno = ENOSPC;
+		return -1;
+	}
+	
+	readINode(id, &curNode);
+	int i;
+	
+	for (i=0; i<14; i++) {
+		curNode.blocks[i] = 0;
+	}
+	
+	curNode.flags |= (isDir) ? INODE_DIR : INODE_FILE | INODE_INLINE;
+	if (!isDir && compressFiles) curNode.flags |= INODE_COMPRESSED;
+	if (!isDir && dedupFiles) curNode.flags |= INODE_DEDUP;
+	curNode.size = (isDir) ? superblock->blockSize : 0;	// set size to 0
+	curNode.childCount = 0; 				// no children in directory
+	curNode.blockCount = (blk != 0);
+	curNode.lastAccess = time(NULL);
+	curNode.lastChange = curNode.lastAccess;
+	curNode.lastModify = curNode.lastAccess;
+	curNode.blocks[0] = blk;
+	writeINode(id, &curNode);
+	return id;
+}
+
+/**
+ * Releases every data and indirection block owned by the INode id, then
+ * clears the INode and marks it free. The caller is responsible for
+ * removing any directory entry that still refers to it.
+ * 
+ * A file with indirection blocks could take a while to free, so it's 
+ * made an orphan instead, and freed in the background by orphanReaper().
+ */
+int releaseTail(INodeID id, bool flush);
+
+void freeINode(INodeID id) {
+    int i;
+    INode curNode;
+    
+    // wait out anyone still reading or writing through an open handle
+    lockINode(id, true);
+    // anything still in its append buffer goes with it
+    releaseTail(id, false);
+    readINode(id, &curNode);
+    
+    if (isFile((&curNode)) && !isInline((&curNode)) && 
+			(curNode.blocks[12] != 0 || curNode.blocks[13] != 0)) {
+		queueOrphan(id, &curNode);
+		unlockINode(id);
+		return;
+	}
+    if (isDir((&curNode))) {
+		// directories address all 14 blocks directly
+		BlockList freed = { NULL, 0, 0 };
+		for (i=0; i<14; i++) {
+			if (curNode.blocks[i] != 0) addBlock(&freed, curNode.blocks[i]);
+		}
+		markBlocksFree(freed.ids, freed.count);
+		free(freed.ids);
+	} else if (!isInline((&curNode))) {
+		unmapBlocks(id, &curNode, 0, INT_MAX);
+	}
+	memset(&curNode, 0, sizeof(INode));
+	writeINode(id, &curNode);
+	// mark INode as free
+	markINodeFree(id);
+	unlockINode(id);
+}
+
+/**
+ * Frees an INode whose last directory entry was just removed. If the
+ * kernel still holds references to it from lookups, it stays allocated
+ * until the last of them is forgotten.
+ */
+void releaseINode(INodeID id) {
+	pthread_mutex_lock(&refLock);
+	if (refs[id].lookups > 0) {
+		refs[id].unlinked = true;
+		pthread_mutex_unlock(&refLock);
+		return;
+	}
+	pthread_mutex_unlock(&refLock);
+	freeINode(id);
+}
+
+/**
+ * Records that the kernel has been handed a reference to id, found in the
+ * directory parent.
+ */
+void refINode(INodeID id, INodeID parent) {
+	pthread_mutex_lock(&refLock);
+	refs[id].lookups++;
+	refs[id].parent = parent;
+	pthread_mutex_unlock(&refLock);
+}
+
+/**
+ * Drops count of the kernel's references to id, freeing it if they were
+ * the last and it has already been unlinked.
+ */
+void forgetINode(INodeID id, uint64_t count) {
+	bool release;
+	pthread_mutex_lock(&refLock);
+	refs[id].lookups -= min(count, refs[id].lookups);
+	release = refs[id].lookups == 0 && refs[id].unlinked;
+	if (release) refs[id].unlinked = false;
+	pthread_mutex_unlock(&refLock);
+	if (release) {
+		beginOp();
+		freeINode(id);
+		endOp();
+	}
+}
+
+/***********************************************************************
+ * 
+ * File operations
+ * 
+ * These work on INodes rather than paths, and leave locking to the caller.
+ * Each returns 0 (or a byte count) on success, or -errno on failure.
+ * 
+ ***********************************************************************/
+
+/**
+ * Updates the access, modify and change times of a directory whose entries
+ * were just changed.
+ */
+void touchDir(INodeID dir) {
+	INode curNode;
+	readINode(dir, &curNode);
+	curNode.lastAccess = time(NULL);
+	curNode.lastChange = curNode.lastAccess;
+	curNode.lastModify = curNode.lastAccess;
+	writeINode(dir, &curNode);
+}
+
+/**
+ * Creates a file, or a directory if dir is set, called name inside of the
+ * directory parent. The new INodeID is stored in id. Caller holds nsLock
+ * for writing.
+ */
+int makeFile(INodeID parent, const char *name, bool dir, INodeID *id) {
+	BlockID blk;
+	int index, err;
+	INode parentNode;
+	
+	if (strlen(name) > 123) return -ENAMETOOLONG;
+	if (findFileEntry(parent, name, &blk, &index) != (INodeID) -1) return -EEXIST;
+	if (errno == ENOTDIR) return -ENOTDIR;
+	readINode(parent, &parentNode);
+	if (parentNode.flags & INODE_SNAPSHOT) return -EROFS;
+	
+	*id = allocateFile(dir);
+	if (*id == (INodeID) -1) return -errno;
+	if (addFileEntry(parent, *id, name) == -1) {
+		// parent is full, give the INode back
+		err = errno;
+		freeINode(*id);
+		return -err;
+	}
+	touchDir(parent);
+	return 0;
+}
+
+/**
+ * Removes the entry name from the directory parent, and frees the file it
+ * named. If dir is set it must name an empty directory, otherwise it must
+ * name a file. Caller holds nsLock for writing.
+ */
+int removeFile(INodeID parent, const char *name, bool dir) {
+	BlockID blk;
 	int index;
-	BlockID block;
 	INode curNode;
-	INodeID fileID = findFileEntry(dir, fname, &block, &index);
-	// read dir to get child count
-	readINode(dir, &curNode);
-	// check if it's the last element
-	if ((block * childrenPerBlock + index) != (curNode.childCount - 1)) {
-		// if we aren't deleting the last element, we have to copy the last element
-		// into the FileEntry of fname
-		FileEntry lastEntry;
+	INodeID id = findFileEntry(parent, name, &blk, &index);
+	if (id == (INodeID) -1) return -errno;
+	
+	readINode(id, &curNode);
+	if (curNode.flags & INODE_SNAPSHOT) return -EROFS;
+	if (dir && !isDir((&curNode))) return -ENOTDIR;
+	if (!dir && isDir((&curNode))) return -EISDIR;
+	// directory needs to be empty
+	if (dir && curNode.childCount > 0) return -ENOTEMPTY;
+	
+    // remove entry from parent directory, by taking the last element
+    // of the parent directory and placing it in place of the entry being removed
+	removeFileEntry(parent, name);
+	touchDir(parent);
+	// free all data blocks connected to INode, and the INode itself
+	releaseINode(id);
+	return 0;
+}
+
+/**
+ * Moves the entry name in parent to newName in newParent. Only the
+ * directory entries move; the INode and its data blocks stay where they
+ * are, so the cost doesn't depend on the size of the file. An existing
+ * file at the destination is replaced, as with rename(2). Moving a
+ * directory inside of itself must be ruled out by the caller. Caller holds
+ * nsLock for writing.
+ */
+int moveFile(INodeID parent, const char *name, INodeID newParent, const char *newName) {
+	INode curNode, target;
+	BlockID blk;
+	int index;
+	INodeID id = findFileEntry(parent, name, &blk, &index);
+	if (id == (INodeID) -1) return -errno;
+	if (strlen(newName) > 123) return -ENAMETOOLONG;
+	
+	readINode(newParent, &target);
+	if (target.flags & INODE_SNAPSHOT) return -EROFS;
+	readINode(id, &curNode);
+	if (curNode.flags & INODE_SNAPSHOT) return -EROFS;
+	INodeID targetID = findFileEntry(newParent, newName, &blk, &index);
+	if (targetID == (INodeID) -1 && errno == ENOTDIR) return -ENOTDIR;
+	// both names already refer to the same file
+	if (targetID == id) return 0;
+	
+	if (targetID != (INodeID) -1) {
+		readINode(targetID, &target);
+		if (isDir((&target)) && !isDir((&curNode))) return -EISDIR;
+		if (!isDir((&target)) && isDir((&curNode))) return -ENOTDIR;
+		if (isDir((&target)) && target.childCount > 0) return -ENOTEMPTY;
+		// point the existing entry at the file being moved, so newName
+		// never stops existing, then release what it used to name
 		FileEntry *entries = malloc(superblock->blockSize);
-		BlockID lastBlk = (curNode.childCount - 1) / childrenPerBlock;
-		int lastIndex = (curNode.childCount - 1) % childrenPerBlock;
-		readBlock(curNode.blocks[lastBlk], entries);
-		// copy last entry
-		memcpy(&lastEntry, &(entries[lastIndex]), sizeof(FileEntry));
-		// read block containing fname
-		readBlock(block, entries);
-		// copy entry into proper index
-		memcpy(&(entries[index]), &lastEntry, sizeof(FileEntry));
-		writeBlock(block, entries);
+		readBlock(blk, entries);
+		entries[index].id = id;
+		writeBlock(blk, entries);
 		free(entries);
+		releaseINode(targetID);
+	} else if (addFileEntry(newParent, id, newName) == -1) {
+		return -errno;
+	}
+	
+	removeFileEntry(parent, name);
+	touchDir(parent);
+	if (newParent != parent) touchDir(newParent);
+	readINode(id, &curNode);
+	curNode.lastChange = time(NULL);
+	writeINode(id, &curNode);
+	return 0;
+}
+
+/**
+ * Fills statbuf with the attributes of the INode id, whose contents are
+ * already in curNode.
+ */
+void fillStat(INodeID id, INode *curNode, struct stat *statbuf) {
+	memset(statbuf, 0, sizeof(struct stat));
+	statbuf->st_mode = ((isDir(curNode)) ? S_IFDIR : S_IFREG) | S_IRWXU | S_IRWXG | S_IRWXO;
+	statbuf->st_nlink = 1;
+	statbuf->st_ino = toIno(id);
+	statbuf->st_uid = 0;
+	statbuf->st_gid = 0;
+	statbuf->st_size = curNode->size;
+	if (refs[id].tail != 0) {
+		// appends still in memory count towards the size
+		TailBuf *tail = &(tails[refs[id].tail - 1]);
+		statbuf->st_size = max(statbuf->st_size, tail->start + tail->len);
+	}
+	statbuf->st_atime = curNode->lastAccess;
+	statbuf->st_mtime = curNode->lastModify;
+	statbuf->st_ctime = curNode->lastChange;
+	statbuf->st_blksize = superblock->blockSize;
+	// a packed tail takes no block of its own, an inline file none at all
+	statbuf->st_blocks = (blkcnt_t) max(curNode->blockCount, 0) * (superblock->blockSize / 512);
+}
+
+/**
+ * Called by listDir() for each entry; next is the offset of the entry that
+ * follows. Returning non-zero stops the listing.
+ */
+typedef int (*DirFiller)(void *ctx, const char *name, INodeID id, struct stat *statbuf, off_t next);
+
+/**
+ * Calls fill with the name and attributes of each entry in the directory
+ * dir, starting with the entry at index start. Returns 1 if fill stopped
+ * the listing early, 0 when every entry was listed. Caller holds nsLock.
+ */
+int listDir(INodeID dir, off_t start, DirFiller fill, void *ctx) {
+	int i, count, remaining, entriesPerBlock, inodesPerBlock;
+	BlockID blk, loadedINodeBlock = 0;
+	FileEntry *ptr;
+	struct stat statbuf;
+	INode curNode;
+	
+	readINode(dir, &curNode);
+	if (!isDir((&curNode))) return -ENOTDIR;
+	if (start >= curNode.childCount) return 0;
+	entriesPerBlock = superblock->blockSize / sizeof(FileEntry);
+	inodesPerBlock = superblock->blockSize / sizeof(INode);
+	
+	FileEntry *entries = malloc(superblock->blockSize);
+	// children are read a whole INode block at a time, since siblings are
+	// usually allocated next to each other
+	INode *inodes = malloc(superblock->blockSize);
+	blk = start / entriesPerBlock;
+	i = start % entriesPerBlock;
+	remaining = curNode.childCount - start + i;
+	
+	// each iteration will read 1 block of data
+	while (remaining > 0) {
+		// read next block
+		readBlock(curNode.blocks[blk++], entries);
+		// read the remaining number of entries, or the whole blocks worth of entities
+		count = min(remaining, entriesPerBlock);
+		remaining -= count;
+		
+		for (; i<count; i++) {
+			// iterate through each entry
+			ptr = &(entries[i]);
+			BlockID inodeBlock = superblock->firstINodeBlock + ptr->id / inodesPerBlock;
+			if (inodeBlock != loadedINodeBlock) {
+				readBlock(inodeBlock, inodes);
+				loadedINodeBlock = inodeBlock;
+			}
+			fillStat(ptr->id, &(inodes[ptr->id % inodesPerBlock]), &statbuf);
+			
+			if (fill(ctx, ptr->value, ptr->id, &statbuf, (blk-1) * entriesPerBlock + i + 1) != 0) {
+				free(entries);
+				free(inodes);
+				return 1;
+			}
+		}
+		i = 0;
+	}
+	free(entries);
+	free(inodes);
+	return 0;
+}
+
+/**
+ * Allocates a handle for the INode id, and stores it in fi. With keepCache,
+ * the kernel is told to keep the pages it has cached for the file if its 
+ * mtime and size are what they were when it was last opened.
+ */
+int openFile(INodeID id, struct fuse_file_info *fi, bool keepCache) {
+    INode curNode;
+    lockINode(id, false);
+    readINode(id, &curNode);
+    unlockINode(id);
+    if ((curNode.flags & INODE_SNAPSHOT) && (fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    int handle = allocateNextHandle();
+    if (handle == -1) return -errno;
+    
+    if (keepCache) {
+		pthread_mutex_lock(&refLock);
+		fi->keep_cache = refs[id].openMtime == curNode.lastModify && 
+			refs[id].openSize == curNode.size;
+		refs[id].openMtime = curNode.lastModify;
+		refs[id].openSize = curNode.size;
+		pthread_mutex_unlock(&refLock);
+	}
+    
+    handles[handle].id = id;
+    handles[handle].flags = fi->flags;
+    handles[handle].index = 0;
+    
+    fi->fh = handle;
+    return 0;
+}
+
+/**
+ * Records a read of the file id, whose INode is in curNode, according to 
+ * the -o atime mode. Under relatime the INode is only written when its 
+ * atime is older than its mtime or ctime, or more than RELATIME_WINDOW 
+ * old, so repeated reads of a file don't turn into INode writes.
+ */
+void touchAtime(INodeID id, INode *curNode) {
+	time_t now;
+	if (atimeMode == ATIME_NOATIME || (curNode->flags & INODE_SNAPSHOT)) return;
+	now = time(NULL);
+	if (atimeMode == ATIME_RELATIME && curNode->lastAccess > curNode->lastModify && 
+			curNode->lastAccess > curNode->lastChange && 
+			now - curNode->lastAccess < RELATIME_WINDOW) {
+		return;
+	}
+	curNode->lastAccess = now;
+	writeINode(id, curNode);
+}
+
+/**
+ * Reads up to size bytes at offset from the file id into buf. Returns the 
+ * number of bytes read. Caller holds the INode's lock.
+ */
+int readFile(INodeID id, char *buf, size_t size, off_t offset) {
+	INode curNode;
+    int relOffset = 0, remaining = size;
+    int blockSize = superblock->blockSize;
+    readINode(id, &curNode);
+    touchAtime(id, &curNode);
+    int curFileSize = curNode.size; 
+    if (offset > curFileSize) {
+         return 0;
+    }
+    int difference = 0;
+    if (size + offset > curFileSize){
+	log_msg("FIXED SIZE size before = %d FILE SIZE = %d\n", size, curFileSize);
+        difference = size + offset - curFileSize;	
+	log_msg("FIXED SIZE difference = %d \n", difference);
+	size = curFileSize - offset;
+	remaining = size;
+	log_msg("FIXED SIZE size - %d\n", size);
+    }
+    if (size == 0) {
+        log_msg("\n size = 0 returning 0 \n");
+        return 0;
+    }
+    if (isInline((&curNode))) {
+		memcpy(buf, (char *) curNode.blocks + offset, size);
+		memset(buf + size, 0, difference);
+		return size;
+	}
+    
+    char * blockBuf = malloc(superblock->blockSize); 
+    BlockID blockToRead = getBlockFromOffset(&curNode, offset);
+    log_msg("\nAbout to read block %d\n",blockToRead);
+    readDataBlock(&curNode, offset, blockToRead, blockBuf);
+    int bytesToRead = min(blockSize-(offset%blockSize), remaining);
+    memcpy(buf, blockBuf + (offset % blockSize), bytesToRead);
+    remaining -= bytesToRead;
+    relOffset += bytesToRead;
+    while (remaining != 0) {
+		blockToRead = getBlockFromOffset(&curNode, offset+relOffset);
+		bytesToRead = min(blockSize, remaining);
+		readDataBlock(&curNode, offset+relOffset, blockToRead, blockBuf);
+		memcpy(buf + (size-remaining), blockBuf, bytesToRead);
+		relOffset += bytesToRead;
+		remaining -= bytesToRead;
+    } 
+    free(blockBuf); 
+    if (difference != 0){
+       memset(buf + size, 0, difference);
+    }
+    log_msg("\nAbout to return %d", size);
+    return size;
+}
+
+/**
+ * Describes size bytes of the file id at offset as a fuse_bufvec, with a 
+ * segment of the image file for each run of contiguous blocks, so fuse 
+ * can move the data without it passing through a buffer of ours. Each 
+ * run of holes gets one malloc'd segment of zeroes, and inline bytes, 
+ * packed tails and compressed clusters a malloc'd copy. Returns the 
+ * number of bytes, or -errno.
+ * Caller holds the INode's lock; the segments are only valid while it 
+ * does, or until the blocks are next rewritten.
+ */
+int readFileBuf(INodeID id, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+	INode curNode;
+	struct fuse_bufvec *bufv;
+	struct fuse_buf *seg = NULL;
+	BlockID blk;
+	off_t pos, end;
+	int i, len, blockSize = superblock->blockSize;
+	bool hole = false;
+	
+	readINode(id, &curNode);
+	touchAtime(id, &curNode);
+	size = (offset >= curNode.size) ? 0 : min(size, curNode.size - offset);
+	
+	// at worst there is a segment for every block the range touches
+	bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * (size / blockSize + 2));
+	if (bufv == NULL) return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(0);
+	if (isInline((&curNode))) {
+		bufv->buf[0].size = size;
+		bufv->buf[0].mem = malloc(size);
+		memcpy(bufv->buf[0].mem, (char *) curNode.blocks + offset, size);
+		*bufp = bufv;
+		return size;
+	}
+	bufv->count = 0;
+	for (end = offset + size; offset < end; offset += len) {
+		len = min(blockSize - offset % blockSize, end - offset);
+		blk = getBlockFromOffset(&curNode, offset);
+		pos = (off_t) blk * blockSize + offset % blockSize;
+		if (blk != 0 && !isPacked(blk) && !isCompressed(blk) && seg != NULL && seg->fd == diskFd && 
+				seg->pos + seg->size == pos) {
+			// physically follows the last segment, so extend it
+			seg->size += len;
+			continue;
+		}
+		if (blk == 0 && hole) {
+			// so does a hole after a hole; its zeroes come at the end
+			seg->size += len;
+			continue;
+		}
+		seg = &(bufv->buf[bufv->count++]);
+		*seg = bufv->buf[0];
+		seg->size = len;
+		hole = blk == 0;
+		if (blk == 0) {
+			seg->flags = 0;
+			seg->fd = -1;
+			seg->mem = NULL;
+		} else if (isPacked(blk) || isCompressed(blk)) {
+			// tail blocks are metadata, so the latest copy may be in the
+			// journal cache rather than the image
+			seg->flags = 0;
+			seg->fd = -1;
+			seg->mem = malloc(blockSize);
+			readDataBlock(&curNode, offset, blk, seg->mem);
+			memmove(seg->mem, (char *) seg->mem + offset % blockSize, len);
+		} else {
+			seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			seg->fd = diskFd;
+			seg->pos = pos;
+			seg->mem = NULL;
+		}
+	}
+	for (i=0; i<bufv->count; i++) {
+		seg = &(bufv->buf[i]);
+		if (!(seg->flags & FUSE_BUF_IS_FD) && seg->mem == NULL) seg->mem = calloc(seg->size, 1);
+	}
+	// an empty read is still one (empty) segment
+	if (bufv->count == 0) bufv->count = 1;
+	*bufp = bufv;
+	return size;
+}
+
+/**
+ * Reads the image segments of a fuse_bufvec from readFileBuf() into 
+ * memory, for a caller that can't hold the INode's lock until the reply 
+ * is sent. Returns 0, or -ENOMEM.
+ */
+int copyBufVec(struct fuse_bufvec *bufv) {
+	struct fuse_buf *seg;
+	size_t i;
+	for (i=0; i<bufv->count; i++) {
+		seg = &(bufv->buf[i]);
+		if (!(seg->flags & FUSE_BUF_IS_FD)) continue;
+		if ((seg->mem = malloc(seg->size)) == NULL) return -ENOMEM;
+		pread(diskFd, seg->mem, seg->size, seg->pos);
+		seg->flags = 0;
+		seg->fd = -1;
+	}
+	return 0;
+}
+
+/**
+ * Frees a fuse_bufvec from readFileBuf(), for the low-level API where
+ * fuse leaves that to us.
+ */
+void freeBufVec(struct fuse_bufvec *bufv) {
+	size_t i;
+	for (i=0; i<bufv->count; i++) {
+		if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) free(bufv->buf[i].mem);
+	}
+	free(bufv);
+}
+
+/**
+ * Copies the next len bytes of src into mem, or straight into the image at 
+ * pos when mem is NULL. Returns 0, or -errno.
+ */
+int copyBufIn(struct fuse_bufvec *src, void *mem, off_t pos, size_t len) {
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	ssize_t res;
+	if (mem != NULL) {
+		dst.buf[0].mem = mem;
+	} else {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = diskFd;
+		dst.buf[0].pos = pos;
+	}
+	res = fuse_buf_copy(&dst, src, 0);
+	if (res < 0) return res;
+	return (res == len) ? 0 : -EIO;
+}
+
+/**
+ * Puts src back at buffer idx, offset off, where a write that's about to
+ * be tried again started. Returns false if that can't be done, because 
+ * bytes have been taken from a pipe in between.
+ */
+bool rewindBufVec(struct fuse_bufvec *src, size_t idx, size_t off) {
+	size_t i;
+	for (i=idx; i<=src->idx && i<src->count; i++) {
+		if ((src->buf[i].flags & FUSE_BUF_IS_FD) && !(src->buf[i].flags & FUSE_BUF_FD_SEEK) &&
+				(i < src->idx || src->off > off)) {
+			return false;
+		}
+	}
+	src->idx = idx;
+	src->off = off;
+	return true;
+}
+
+/**
+ * Copies the run of *runLen bytes waiting in src, if there is one, into 
+ * the image from block start, and empties it. Returns 0, or -errno.
+ */
+int flushRun(struct fuse_bufvec *src, BlockID start, size_t *runLen) {
+	size_t len = *runLen;
+	*runLen = 0;
+	return (len == 0) ? 0 : copyBufIn(src, NULL, (off_t) start * superblock->blockSize, len);
+}
+
+/**
+ * Returns whether the len bytes at buf are all zero. They are or'ed 
+ * together 64 at a time, in SSE2 registers where there are any, so a 
+ * block that isn't zero is usually turned down in its first few bytes.
+ */
+bool isZero(const void *buf, size_t len) {
+	const char *p = buf;
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i acc;
+	for (; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i)), 
+				_mm_loadu_si128((const __m128i *) (p + i + 16))), 
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i + 32)), 
+				_mm_loadu_si128((const __m128i *) (p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return false;
+	}
+#else
+	uint64_t word;
+	for (; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, p + i, sizeof(word));
+		if (word != 0) return false;
+	}
+#endif
+	for (; i < len; i++) {
+		if (p[i] != 0) return false;
+	}
+	return true;
+}
+
+/**
+ * Returns whether the len bytes of src that come skip bytes after its 
+ * next one are in memory and all zero. Bytes in a pipe can't be looked 
+ * at without taking them, so they never are.
+ */
+bool srcZeroes(struct fuse_bufvec *src, size_t skip, size_t len) {
+	struct fuse_buf *buf = &(src->buf[src->idx]);
+	if (src->idx >= src->count || (buf->flags & FUSE_BUF_IS_FD) || 
+			buf->size - src->off < skip + len) {
+		return false;
+	}
+	return isZero((char *) buf->mem + src->off + skip, len);
+}
+
+/**
+ * Moves src past the next len bytes, which srcZeroes() found in memory.
+ */
+void skipBuf(struct fuse_bufvec *src, size_t len) {
+	src->off += len;
+	if (src->off == src->buf[src->idx].size) {
+		src->idx++;
+		src->off = 0;
+	}
+}
+
+/**
+ * Writes data, a whole block, at block index of the file id, where blk is
+ * mapped now. A copy of it already in the dedup index is shared instead; 
+ * otherwise it's written and indexed. Returns 0, or -errno.
+ */
+int dedupBlock(INodeID id, INode *curNode, int index, BlockID blk, char *data) {
+	uint32_t fp = fingerprint(data);
+	BlockID copy = findDuplicate(fp, data);
+	int res;
+	
+	if (copy != 0) {
+		__sync_fetch_and_add(&dedupHits, 1);
+		// the owner findDuplicate() added goes again if the block is 
+		// already this one
+		if (copy == blk || mapBlock(id, curNode, index, copy) == (BlockID) -1) {
+			res = (copy == blk) ? 0 : -errno;
+			markBlocksFree(&copy, 1);
+			return res;
+		}
+		if (blk != 0) markBlocksFree(&blk, 1);
+		return 0;
+	}
+	if (blk == 0) {
+		if ((blk = mapBlock(id, curNode, index, 0)) == (BlockID) -1) return -errno;
+	} else if (isShared(blk) && (res = unshareBlock(id, curNode, index, &blk, false)) != 0) {
+		return res;
+	}
+	writeFileBlock(blk, data);
+	indexBlock(blk, fp);
+	noteMapChange(id);
+	return 0;
+}
+
+/**
+ * Writes the contents of src into the file id at offset, growing the file
+ * as needed. Runs of whole blocks that sit next to each other on disk are
+ * copied (or spliced) straight into the image; only partial blocks at
+ * either end are read, patched and written back. A compressed file takes
+ * whole clusters through memory to compress them, and compresses a 
+ * cluster that a smaller write finishes from the disk. A deduplicated 
+ * file takes whole blocks through memory to look them up. Zeroes written
+ * into a hole leave it a hole; a block that's mapped already, such as one
+ * fallocate set aside, is written like any other, so it keeps its place.
+ * Returns the number of bytes written. Caller holds the INode's lock for
+ * writing.
+ * 
+ * This goes straight to disk, see writeFileBuf() for the buffered path.
+ */
+int writeData(INodeID id, struct fuse_bufvec *src, off_t offset) {
+	INode curNode;
+	BlockID blk, runStart = 0;
+	size_t len, runLen = 0;
+	off_t pos, done, end = offset + fuse_buf_size(src);
+	int res = 0, blockSize = superblock->blockSize, head, tail;
+	int clusterSize = CLUSTER_BLOCKS * blockSize;
+	bool fresh, packing, deduping;
+	char *blockBuf = NULL, *clusterBuf = NULL;
+	BlockID ids[CLUSTER_BLOCKS];
+	
+	// a gap between the end of the file and offset is left as a hole
+	readINode(id, &curNode);
+	if (isInline((&curNode))) {
+		if (end <= INLINE_SIZE) {
+			res = copyBufIn(src, (char *) curNode.blocks + offset, 0, end - offset);
+			if (res != 0) return res;
+			curNode.size = max(curNode.size, end);
+			curNode.lastAccess = time(NULL);
+			curNode.lastChange = curNode.lastAccess;
+			curNode.lastModify = curNode.lastAccess;
+			writeINode(id, &curNode);
+			return end - offset;
+		}
+		if ((res = uninlineFile(id, &curNode)) != 0) return res;
+	}
+	if ((res = unpackTail(id, &curNode)) != 0) return res;
+	refs[id].dataDirty = true;
+	packing = curNode.flags & INODE_COMPRESSED;
+	deduping = curNode.flags & INODE_DEDUP;
+	
+	// the bytes before done are in the image, and those in [pos - runLen, pos)
+	// are waiting to go in as a single copy
+	done = offset;
+	for (pos = offset; pos < end; pos += len) {
+		len = min(blockSize - pos % blockSize, end - pos);
+		if (packing && pos % clusterSize == 0 && end - pos >= clusterSize) {
+			if ((res = flushRun(src, runStart, &runLen)) != 0) break;
+			done = pos;
+			if (clusterBuf == NULL) clusterBuf = malloc(clusterSize);
+			if ((res = copyBufIn(src, clusterBuf, 0, clusterSize)) != 0) break;
+			getCluster(&curNode, pos / clusterSize, ids);
+			if (clusterIsHole(ids) && isZero(clusterBuf, clusterSize)) {
+				__sync_fetch_and_add(&zeroBytes, clusterSize);
+			} else {
+				res = packCluster(id, &curNode, pos / clusterSize, clusterBuf);
+				if (res == 1) res = writeCluster(id, &curNode, pos / clusterSize, clusterBuf);
+				if (res != 0) break;
+			}
+			len = clusterSize;
+			done = pos + len;
+			continue;
+		}
+		blk = getBlockFromOffset(&curNode, pos);
+		if (isCompressed(blk)) {
+			// only part of the cluster is written
+			if ((res = expandCluster(id, &curNode, pos / clusterSize)) != 0) break;
+			blk = getBlockFromOffset(&curNode, pos);
+		}
+		if (blk == 0 && srcZeroes(src, runLen, len)) {
+			if ((res = flushRun(src, runStart, &runLen)) != 0) break;
+			skipBuf(src, len);
+			__sync_fetch_and_add(&zeroBytes, len);
+			done = pos + len;
+			continue;
+		}
+		if (deduping && len == blockSize) {
+			if ((res = flushRun(src, runStart, &runLen)) != 0) break;
+			done = pos;
+			if (blockBuf == NULL) blockBuf = malloc(blockSize);
+			if ((res = copyBufIn(src, blockBuf, 0, len)) != 0) break;
+			if (blk == 0 && isZero(blockBuf, blockSize)) {
+				__sync_fetch_and_add(&zeroBytes, len);
+			} else if ((res = dedupBlock(id, &curNode, pos / blockSize, blk, blockBuf)) != 0) {
+				break;
+			}
+			done = pos + len;
+			continue;
+		}
+		fresh = blk == 0;
+		if (!fresh && isShared(blk)) {
+			// a whole block is written over, so only a partial one needs 
+			// the old bytes copied
+			res = unshareBlock(id, &curNode, pos / blockSize, &blk, len < blockSize);
+			if (res != 0) break;
+		} else if (fresh) {
+			blk = mapBlock(id, &curNode, pos / blockSize, 0);
+			if (blk == (BlockID) -1) {
+				// ran out of space, keep whatever made it in
+				res = -errno;
+				break;
+			}
+		}
+		if (len == blockSize && runLen > 0 && runStart + runLen / blockSize == blk) {
+			runLen += len;
+			continue;
+		}
+		if ((res = flushRun(src, runStart, &runLen)) != 0) break;
+		done = pos;
+		if (len == blockSize) {
+			runStart = blk;
+			runLen = len;
+			continue;
+		}
+		if (blockBuf == NULL) blockBuf = malloc(blockSize);
+		// the block only has to be read if it holds file bytes on either 
+		// side of the write; a new block, or one whose bytes after the 
+		// write are past the end of the file, is just zeroed
+		head = pos % blockSize;
+		tail = min(blockSize, curNode.size - (pos - head)) - (head + (int) len);
+		if (!fresh && (head > 0 || tail > 0)) {
+			readBlock(blk, blockBuf);
+			__sync_fetch_and_add(&rmwReads, 1);
+		} else {
+			memset(blockBuf, 0, blockSize);
+			__sync_fetch_and_add(&rmwReadsSaved, 1);
+		}
+		res = copyBufIn(src, blockBuf + pos % blockSize, 0, len);
+		if (res != 0) break;
+		writeFileBlock(blk, blockBuf);
+		done = pos + len;
+	}
+	if (runLen > 0 && flushRun(src, runStart, &runLen) == 0) {
+		done = pos;
+	}
+	free(blockBuf);
+	if (done == offset) {
+		free(clusterBuf);
+		return res;
+	}
+	
+	curNode.size = max(curNode.size, done);
+	curNode.lastAccess = time(NULL);
+	curNode.lastChange = curNode.lastAccess;
+	curNode.lastModify = curNode.lastAccess;
+	if (packing && done % clusterSize == 0 && done - clusterSize < offset) {
+		// the write finished a cluster it didn't start, such as the last
+		// block of appends. If it can't be compressed it stays as it is
+		if (clusterBuf == NULL) clusterBuf = malloc(clusterSize);
+		if (readCluster(&curNode, done / clusterSize - 1, clusterBuf) == 0) {
+			packCluster(id, &curNode, done / clusterSize - 1, clusterBuf);
+		}
 	}
-	
-	curNode.childCount--;
-	writeINode(dir, &curNode);
-	return;
+	free(clusterBuf);
+	writeINode(id, &curNode);
+	return done - offset;
 }
 
-
 /***********************************************************************
  * 
- * Directory navigation methods
+ * Append buffers
+ * 
+ * Small appends to a file are gathered in memory, in a buffer holding the
+ * file's last partial block, and written out a whole block at a time. A
+ * buffer is written out when it fills, when anything other than another
+ * append touches the file, on fsync and release, and by tailFlusher once
+ * it has been dirty for TAIL_TIMEOUT seconds.
+ * 
+ * Slots are handed out under tailLock; their contents belong to whoever
+ * holds the INode's lock.
  * 
  ***********************************************************************/
 
-int indexOf(const char *str, char val) {
-	int i = 0;
-	for (i=0; i<strlen(str); i++) {
-		if (str[i] == val) return i;
+/**
+ * Returns the append buffer of id, or NULL if it has none.
+ */
+TailBuf *getTail(INodeID id) {
+	return (refs[id].tail == 0) ? NULL : &(tails[refs[id].tail - 1]);
+}
+
+/**
+ * Writes out the buffered bytes of id's append buffer. Once a whole block
+ * is out the buffer moves on to the next one. Returns 0, or -errno.
+ */
+int flushTail(INodeID id, TailBuf *tail) {
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(tail->len);
+	int res;
+	if (!tail->dirty) return 0;
+	src.buf[0].mem = tail->data;
+	res = writeData(id, &src, tail->start);
+	if (res < 0) return res;
+	tail->dirty = false;
+	if (tail->len == superblock->blockSize) {
+		tail->start += tail->len;
+		tail->len = 0;
 	}
-	return -1;
+	return 0;
 }
 
-int lastIndexOf(const char *str, char val) {
-	int i;
-	for (i=strlen(str)-1; i>=0; i--) {
-		if (str[i] == val) return i;
+/**
+ * Gives id's append buffer back, first writing it out if flush is set.
+ * The slot is cleared whole, so nothing of id's is left in it for the 
+ * next file to take it. Returns 0, or -errno if it couldn't be written 
+ * (in which case it's kept).
+ */
+int releaseTail(INodeID id, bool flush) {
+	TailBuf *tail = getTail(id);
+	int res;
+	if (tail == NULL) return 0;
+	if (flush && (res = flushTail(id, tail)) != 0) return res;
+	pthread_mutex_lock(&tailLock);
+	tail->used = false;
+	tail->dirty = false;
+	tail->id = 0;
+	tail->start = 0;
+	tail->len = 0;
+	refs[id].tail = 0;
+	pthread_mutex_unlock(&tailLock);
+	return 0;
+}
+
+/**
+ * Takes a free append buffer for id, loaded with the file's last partial
+ * block. Returns NULL if they are all in use.
+ */
+TailBuf *allocateTail(INodeID id, INode *curNode) {
+	int i, blockSize = superblock->blockSize;
+	TailBuf *tail = NULL;
+	pthread_mutex_lock(&tailLock);
+	for (i=0; i<NUM_TAILS; i++) {
+		if (!tails[i].used) {
+			tail = &(tails[i]);
+			tail->used = true;
+			tail->id = id;
+			break;
+		}
 	}
-	return -1;
+	pthread_mutex_unlock(&tailLock);
+	if (tail == NULL) return NULL;
+	
+	tail->dirty = false;
+	tail->start = curNode->size - curNode->size % blockSize;
+	tail->len = curNode->size % blockSize;
+	if (tail->len > 0) readFileBlock(getBlockFromOffset(curNode, tail->start), tail->data);
+	refs[id].tail = i + 1;
+	return tail;
 }
 
 /**
- * Recursive function call to find file. Starting at the root directory, 
- * it goes through each directory in a specified path, to find the INode of
- * a specific file or directory. It does not care what the last INode represents,
- * only that it exists.
- * 
- * Returns the INodeID of the file specified by path, or -1 if it, or a parent
- * of it, does not exist.
+ * Tries to take a write of size bytes at offset into id's append buffer.
+ * Returns the number of bytes taken, which is 0 if the write has to go to
+ * disk instead; any buffered bytes are written out first in that case.
  */
-INodeID findFileInternal(INodeID dir, char *path);
+int appendTail(INodeID id, struct fuse_bufvec *src, size_t size, off_t offset) {
+	INode curNode;
+	TailBuf *tail = getTail(id);
+	int res, count, taken = 0, blockSize = superblock->blockSize;
+	
+	if (size == 0) return 0;
+	if (tail == NULL) {
+		readINode(id, &curNode);
+		if (size >= blockSize || offset != curNode.size || isInline((&curNode))) return 0;
+		tail = allocateTail(id, &curNode);
+		if (tail == NULL) return 0;
+	} else if (size >= blockSize || offset != tail->start + tail->len) {
+		return releaseTail(id, true);
+	}
+	
+	while (size > 0) {
+		count = min(blockSize - tail->len, (int) size);
+		res = copyBufIn(src, tail->data + tail->len, 0, count);
+		if (res != 0) return (taken > 0) ? taken : res;
+		if (!tail->dirty) tail->dirtySince = time(NULL);
+		tail->dirty = true;
+		tail->len += count;
+		taken += count;
+		size -= count;
+		if (tail->len == blockSize && (res = flushTail(id, tail)) != 0) {
+			return (taken > count) ? taken - count : res;
+		}
+	}
+	return taken;
+}
 
-INodeID findFileInternal(INodeID dir, char *path) {
-	//log_msg("\nLOOKING FOR: %s IN %d\n", path, dir);
-	if (strlen(path) == 0) {
-		// if there is no length, return current directory
-		return dir;
+/**
+ * Writes the contents of src into the file id at offset, through its 
+ * append buffer if it's a small append. Returns the number of bytes 
+ * written. Caller holds the INode's lock for writing.
+ */
+int writeFileBuf(INodeID id, struct fuse_bufvec *src, off_t offset) {
+	int res = appendTail(id, src, fuse_buf_size(src), offset);
+	if (res != 0) return res;
+	return writeData(id, src, offset);
+}
+
+/**
+ * Writes size bytes from buf into the file id at offset, growing the file
+ * as needed. Returns the number of bytes written. Caller holds the INode's
+ * lock for writing.
+ */
+int writeFile(INodeID id, const char *buf, size_t size, off_t offset) {
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *) buf;
+	return writeFileBuf(id, &src, offset);
+}
+
+/**
+ * Zeroes the bytes from start to end of the file id with the INode curNode,
+ * which lie within a single block. Nothing needs doing for a hole. Returns
+ * 0, or -errno with the bytes unchanged.
+ */
+int zeroFileRange(INodeID id, INode *curNode, off_t start, off_t end) {
+	int res, blockSize = superblock->blockSize;
+	BlockID blk = getBlockFromOffset(curNode, start);
+	if (blk == 0 || start >= end) return 0;
+	if (isCompressed(blk)) {
+		if ((res = expandCluster(id, curNode, start / (CLUSTER_BLOCKS * blockSize))) != 0) return res;
+		blk = getBlockFromOffset(curNode, start);
 	}
+	if (isShared(blk) && (res = unshareBlock(id, curNode, start / blockSize, &blk, true)) != 0) {
+		return res;
+	}
+	char *blockBuf = malloc(blockSize);
+	readBlock(blk, blockBuf);
+	memset(blockBuf + start % blockSize, 0, end - start);
+	writeFileBlock(blk, blockBuf);
+	free(blockBuf);
+	return 0;
+}
+
+/**
+ * Allocates or deallocates the space for length bytes of the file id at
+ * offset, as fallocate(2). By default every hole in the range gets a 
+ * zeroed block, and the file grows to cover the range unless 
+ * FALLOC_FL_KEEP_SIZE is given. FALLOC_FL_PUNCH_HOLE frees the blocks 
+ * inside the range instead, zeroing the partial blocks at either end. 
+ * Caller holds the INode's lock for writing.
+ */
+int allocateFileRange(INodeID id, int mode, off_t offset, off_t length) {
+	INode curNode;
+	BlockID blk;
+	int i, res, first, end, blockSize = superblock->blockSize;
+	off_t stop = offset + length;
 	
-	int br = indexOf(path, '/');
-	char *nextPath = path;
+	if (offset < 0 || length <= 0) return -EINVAL;
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0) return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+	if ((res = releaseTail(id, true)) != 0) return res;
+	readINode(id, &curNode);
+	if (curNode.flags & INODE_SNAPSHOT) return -EROFS;
+	if ((res = unpackTail(id, &curNode)) != 0) return res;
+	refs[id].dataDirty = true;
 	
-	if (br == -1) {
-		// on the last file!
-		nextPath = nextPath + strlen(nextPath);
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && isInline((&curNode))) {
+		zeroInline(&curNode, offset, min(stop, curNode.size));
+	} else if (mode & FALLOC_FL_PUNCH_HOLE) {
+		// the range may run past the end, over blocks preallocated there
+		stop = min(stop, (off_t) INT_MAX);
+		if (offset >= stop) return 0;
+		// whole blocks from first to end are unmapped. That includes the
+		// last block when the range covers the end of the file, since 
+		// nothing past the end is ever read
+		first = (offset + blockSize - 1) / blockSize;
+		end = (stop >= curNode.size) ? (stop + blockSize - 1) / blockSize : stop / blockSize;
+		if (offset < curNode.size && (res = zeroFileRange(id, &curNode, offset, 
+				min(min(stop, (off_t) curNode.size), (off_t) first * blockSize))) != 0) {
+			return res;
+		}
+		if (end >= first && stop < curNode.size && 
+				(res = zeroFileRange(id, &curNode, (off_t) end * blockSize, stop)) != 0) {
+			return res;
+		}
+		if (end > first && (res = breakClusters(id, &curNode, first, end)) != 0) return res;
+		if (end > first) unmapBlocks(id, &curNode, first, end);
 	} else {
-		// still in a directory, so we will need to search deeper
-		// set the '/' to \0 to end the string of the subdir to move to
-		nextPath[br] = 0;
-		// move nextPath up to exclude this subdir
-		nextPath = nextPath + br + 1;
+		// preallocating means real blocks
+		if (isInline((&curNode)) && (res = uninlineFile(id, &curNode)) != 0) return res;
+		char *zeroes = calloc(blockSize, 1);
+		for (i = offset / blockSize; i <= (stop - 1) / blockSize; i++) {
+			if (getBlockFromOffset(&curNode, i * blockSize) != 0) continue;
+			if ((blk = mapBlock(id, &curNode, i, 0)) == (BlockID) -1) {
+				res = -errno;
+				break;
+			}
+			writeFileBlock(blk, zeroes);
+		}
+		free(zeroes);
+		if (res != 0) return res;
+		if (!(mode & FALLOC_FL_KEEP_SIZE)) curNode.size = max(curNode.size, stop);
 	}
+	curNode.lastChange = time(NULL);
+	curNode.lastModify = curNode.lastChange;
+	writeINode(id, &curNode);
+	return 0;
+}
+
+/**
+ * Sets the size of the file id to size, as truncate(2). Blocks wholly past
+ * the new end are unmapped in one go, including any preallocated past the
+ * old end, and the rest of the new last block is zeroed so that growing 
+ * the file again reads zeroes. A file grows by a hole. Caller holds the 
+ * INode's lock for writing.
+ */
+int truncateFile(INodeID id, off_t size) {
+	INode curNode;
+	int res, first, blockSize = superblock->blockSize;
+	off_t blockEnd = (size + blockSize - 1) / blockSize * blockSize;
 	
-	if (strlen(path) > 123) {
-		// ensure path length is okay
-		errno = ENAMETOOLONG;
-		return -1;
+	if (size < 0) return -EINVAL;
+	if (size > INT_MAX) return -EFBIG;
+	if ((res = releaseTail(id, true)) != 0) return res;
+	readINode(id, &curNode);
+	if (!isFile((&curNode))) return -EISDIR;
+	if (curNode.flags & INODE_SNAPSHOT) return -EROFS;
+	if ((res = unpackTail(id, &curNode)) != 0) return res;
+	refs[id].dataDirty = true;
+	
+	if (isInline((&curNode)) && size > INLINE_SIZE) {
+		if ((res = uninlineFile(id, &curNode)) != 0) return res;
+	}
+	if (isInline((&curNode))) {
+		zeroInline(&curNode, size, curNode.size);
+	} else {
+		first = blockEnd / blockSize;
+		if (size < curNode.size) {
+			// fails before anything is given up, or the file would end 
+			// in bytes that should be gone
+			res = zeroFileRange(id, &curNode, size, min(blockEnd, (off_t) curNode.size));
+			if (res != 0) return res;
+		} else if (blockEnd < INT_MAX && isCompressed(getBlockFromOffset(&curNode, blockEnd))) {
+			// growing only has preallocated blocks to drop, which aren't
+			// worth expanding a compressed cluster for
+			first = (first + CLUSTER_BLOCKS - 1) / CLUSTER_BLOCKS * CLUSTER_BLOCKS;
+		}
+		if ((res = breakClusters(id, &curNode, first, INT_MAX)) != 0) return res;
+		unmapBlocks(id, &curNode, first, INT_MAX);
 	}
+	curNode.size = size;
+	curNode.lastChange = time(NULL);
+	curNode.lastModify = curNode.lastChange;
+	writeINode(id, &curNode);
+	return 0;
+}
+
+/**
+ * Maps a copy of frag, the packed tail of another file, as block index of
+ * the file id with the INode curNode, freeing whatever was mapped there.
+ * The copy gets fragments of its own, or a block if there's no room for 
+ * them. Returns 0, or -errno with the file unchanged.
+ */
+int copyPacked(INodeID id, INode *curNode, int index, BlockID frag) {
+	BlockID copy, old = getBlockFromOffset(curNode, (off_t) index * superblock->blockSize);
+	BlockList freed = { NULL, 0, 0 };
+	char *blockBuf = malloc(superblock->blockSize);
+	int res;
 	
-	BlockID blk;
-	INodeID id;
-	int index;
-	//log_msg("CUR: %s NEXT: %s\n\n", path, nextPath);
-	id = findFileEntry(dir, path, &blk, &index);
-	if (id == (INodeID) -1) return -1;
+	readFileBlock(frag, blockBuf);
+	if ((copy = allocateFrags(packedCount(frag))) != 0) {
+		writeBlockPart(packedBlock(copy), blockBuf, packedFrag(copy) * FRAG_SIZE, packedCount(copy) * FRAG_SIZE);
+	} else if ((copy = allocateNextBlock()) != (BlockID) -1) {
+		writeFileBlock(copy, blockBuf);
+	} else {
+		free(blockBuf);
+		return -ENOSPC;
+	}
+	free(blockBuf);
+	if (mapBlock(id, curNode, index, copy) == (BlockID) -1) {
+		res = -errno;
+		addBlock(&freed, copy);
+		freeMapped(&freed);
+		return res;
+	}
+	if (old != 0) addBlock(&freed, old);
+	freeMapped(&freed);
+	return 0;
+}
+
+/**
+ * Makes length bytes of the file src at srcOffset the contents of the 
+ * file id at offset, as FICLONERANGE, by sharing src's blocks rather than 
+ * copying them. A length of 0 runs to the end of src. The offsets must be
+ * block aligned, and so must length unless the range runs to the end of 
+ * src and past the end of id. Caller holds both INodes' locks for writing.
+ * Returns 0, or -errno.
+ */
+int cloneFile(INodeID id, off_t offset, INodeID src, off_t srcOffset, off_t length) {
+	INode curNode, srcNode;
+	BlockID blk, old;
+	int i, k, n, first, res = 0, blockSize = superblock->blockSize;
+	off_t end;
 	
-	return findFileInternal(id, nextPath);
+	if (id == src || offset < 0 || srcOffset < 0 || length < 0) return -EINVAL;
+	// src's append buffer only has to be written out; it can go on being
+	// appended to once this is done
+	if ((res = releaseTail(id, true)) != 0) return res;
+	if (getTail(src) != NULL && (res = flushTail(src, getTail(src))) != 0) return res;
+	readINode(id, &curNode);
+	readINode(src, &srcNode);
+	if (isFree((&srcNode)) || !isFile((&srcNode)) || !isFile((&curNode))) return -EINVAL;
+	// an orphan's blocks are on their way to being freed
+	if (srcNode.flags & INODE_ORPHAN) return -EINVAL;
+	if (curNode.flags & INODE_SNAPSHOT) return -EROFS;
+	if (srcOffset > srcNode.size) return -EINVAL;
+	if (length == 0 || srcOffset + length > srcNode.size) length = srcNode.size - srcOffset;
+	if (offset + length > INT_MAX) return -EFBIG;
+	if (offset % blockSize != 0 || srcOffset % blockSize != 0) return -EINVAL;
+	// the rest of a partial last block is zeroes, which may only stand in
+	// for bytes past the end of id
+	if (length % blockSize != 0 && 
+			(srcOffset + length < srcNode.size || offset + length < curNode.size)) {
+		return -EINVAL;
+	}
+	if (length == 0) return 0;
+	
+	if (isInline((&srcNode))) {
+		// too small to share, so the bytes are copied
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(length);
+		buf.buf[0].mem = (char *) srcNode.blocks + srcOffset;
+		res = writeData(id, &buf, offset);
+		return (res < 0) ? res : 0;
+	}
+	if (isInline((&curNode)) && (res = uninlineFile(id, &curNode)) != 0) return res;
+	if ((res = unpackTail(id, &curNode)) != 0) return res;
+	
+	first = offset / blockSize;
+	n = (length + blockSize - 1) / blockSize;
+	if ((res = breakClusters(id, &curNode, first, first + n)) != 0) return res;
+	// each block of id is only given up once what replaces it is mapped, 
+	// so a failure part way leaves the rest as they were
+	for (i=0; i<n; i++) {
+		blk = getBlockFromOffset(&srcNode, srcOffset + (off_t) i * blockSize);
+		if (isCompressed(blk) && (first + i) % CLUSTER_BLOCKS == 0 && 
+				(srcOffset / blockSize + i) % CLUSTER_BLOCKS == 0 && i + CLUSTER_BLOCKS <= n) {
+			// a whole compressed cluster lands on a cluster of id
+			BlockID ids[CLUSTER_BLOCKS], old[CLUSTER_BLOCKS];
+			BlockList freed = { NULL, 0, 0 };
+			getCluster(&srcNode, (srcOffset / blockSize + i) / CLUSTER_BLOCKS, ids);
+			getCluster(&curNode, (first + i) / CLUSTER_BLOCKS, old);
+			if ((res = shareCluster(id, &curNode, (first + i) / CLUSTER_BLOCKS, ids)) != 0) break;
+			for (k=0; k<CLUSTER_BLOCKS; k++) {
+				if (old[k] != 0) addBlock(&freed, old[k]);
+			}
+			freeMapped(&freed);
+			i += CLUSTER_BLOCKS - 1;
+			continue;
+		}
+		if (isCompressed(blk)) {
+			// any other part of one has to be copied out of it first
+			if ((res = expandCluster(src, &srcNode, (srcOffset / blockSize + i) / CLUSTER_BLOCKS)) != 0) break;
+			blk = getBlockFromOffset(&srcNode, srcOffset + (off_t) i * blockSize);
+		}
+		if (isPacked(blk)) {
+			// fragments can't be shared, so src's packed tail is copied
+			// rather than unpacked
+			if ((res = copyPacked(id, &curNode, first + i, blk)) != 0) break;
+			continue;
+		}
+		old = getBlockFromOffset(&curNode, (off_t) (first + i) * blockSize);
+		if (blk == 0) {
+			if (old != 0) unmapBlocks(id, &curNode, first + i, first + i + 1);
+			continue;
+		}
+		if ((res = shareBlock(blk)) != 0) break;
+		if (mapBlock(id, &curNode, first + i, blk) == (BlockID) -1) {
+			res = -errno;
+			markBlocksFree(&blk, 1);
+			break;
+		}
+		if (old != 0) markBlocksFree(&old, 1);
+	}
+	// like a short write, whatever was cloned before a failure stays
+	end = min(offset + length, (off_t) (first + i) * blockSize);
+	curNode.size = max(curNode.size, end);
+	curNode.lastChange = time(NULL);
+	curNode.lastModify = curNode.lastChange;
+	writeINode(id, &curNode);
+	return res;
 }
 
+/**
+ * Locks id for reading with nothing left in its append buffer, so that 
+ * readers only have to look at the disk. Returns 0, or -errno if the 
+ * buffer couldn't be written out, still holding the lock either way.
+ */
+int lockINodeFlushed(INodeID id) {
+	int res = 0;
+	lockINode(id, false);
+	while (res == 0 && getTail(id) != NULL && getTail(id)->dirty) {
+		unlockINode(id);
+		lockINode(id, true);
+		if (getTail(id) != NULL) res = flushTail(id, getTail(id));
+		unlockINode(id);
+		lockINode(id, false);
+	}
+	return res;
+}
 
 /**
- * Actual function call, that uses findFileInternal
+ * Makes the file id durable, as fsync(2), or fdatasync(2) if datasync is
+ * set. Only the transaction that last changed what's needed is waited 
+ * for, and if that's committed already, only the data is synced. Takes
+ * the INode's lock itself, and must not be called inside an operation.
+ * Returns 0, or -errno.
  */
-INodeID findFile(const char *path) {
-	// newPath always points to the start of the malloc()'ed space. PTR may change.
-	char *newPath = malloc(strlen(path)+1);
-	strcpy(newPath, path);
-	char *ptr = newPath;
+int syncFile(INodeID id, bool datasync) {
+	uint32_t txn;
+	bool data;
+	int res;
 	
-	if (ptr[0] != '/') {
-		// need absolute path
-		free(newPath);
-		errno = EIO;
-		return -1;
-	} else {
-		// remove leading '/'
-		ptr += 1;
+	beginOp();
+	lockINode(id, true);
+	res = (getTail(id) == NULL) ? 0 : flushTail(id, getTail(id));
+	txn = refs[id].syncTxn;
+	if (!datasync) txn = max(txn, refs[id].attrTxn);
+	data = refs[id].dataDirty;
+	refs[id].dataDirty = false;
+	unlockINode(id);
+	endOp();
+	if (res != 0) return res;
+	
+	pthread_mutex_lock(&journalLock);
+	if (txn <= committedTxn) txn = 0;
+	pthread_mutex_unlock(&journalLock);
+	// the commit syncs the data too. The image is a single file, so 
+	// syncing data means syncing all of it
+	if (txn != 0 || jcache == NULL) {
+		syncJournal(txn);
+	} else if (data && fdatasync(diskFd) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Returns the kernel's ID for the mount at mountpoint, from 
+ * /proc/self/mountinfo, or -1 if it isn't there. The last mount there is 
+ * the one that's seen.
+ */
+int findMountID(const char *mountpoint) {
+	char line[PATH_MAX + 256], dir[PATH_MAX];
+	int id, found = -1;
+	FILE *info;
+	
+	if (mountpoint == NULL || (info = fopen("/proc/self/mountinfo", "r")) == NULL) return -1;
+	while (fgets(line, sizeof(line), info) != NULL) {
+		// mount ID, parent ID, device, root, mount point, ...
+		if (sscanf(line, "%d %*d %*s %*s %4095s", &id, dir) == 2 && strcmp(dir, mountpoint) == 0) {
+			found = id;
+		}
 	}
+	fclose(info);
+	return found;
+}
+
+/**
+ * Finds the file open as fd in the process pid, from its 
+ * /proc/<pid>/fdinfo, as the kernel would for FICLONE. It has to be open
+ * for reading, on this mount. Returns the INode, or -errno.
+ */
+int64_t fdINode(pid_t pid, int64_t fd) {
+	char path[64], line[256];
+	unsigned long long ino = 0;
+	int flags = -1, mnt = -1;
+	FILE *info;
 	
-	if (ptr[strlen(ptr)-1] == '/') {
-		// remove trailing '/', as we do not care what the endpoint is
-		ptr[strlen(ptr)-1] = 0;
+	if (fd < 0 || fd > INT_MAX) return -EBADF;
+	snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", (int) pid, (int) fd);
+	if ((info = fopen(path, "r")) == NULL) return -EBADF;
+	while (fgets(line, sizeof(line), info) != NULL) {
+		sscanf(line, "flags: %o", &flags);
+		sscanf(line, "mnt_id: %d", &mnt);
+		sscanf(line, "ino: %llu", &ino);
 	}
+	fclose(info);
+	if (flags == -1 || (flags & O_ACCMODE) == O_WRONLY) return -EBADF;
+	if (mountID == -1 || mnt != mountID) return -EXDEV;
+	if (ino == 0 || fromIno(ino) >= superblock->numINodes) return -EBADF;
+	return fromIno(ino);
+}
+
+/**
+ * Carries out SFS_IOC_CLONE, made by the process pid, on the file id, see
+ * cloneFile(). Takes the locks itself. Returns 0, or -errno.
+ */
+int cloneRange(INodeID id, const CloneRange *range, pid_t pid) {
+	int64_t found = fdINode(pid, range->srcFd);
+	INodeID src = (INodeID) found;
+	int res;
 	
-	INodeID id = findFileInternal(0, ptr);
-	free(newPath);
-	return id;
+	if (found < 0) return (int) found;
+	beginChange();
+	beginBulkOp();
+	lockINodePair(id, src);
+	res = cloneFile(id, range->offset, src, range->srcOffset, range->length);
+	unlockINodePair(id, src);
+	endOp();
+	endChange();
+	return res;
 }
 
-INodeID findParent(const char *path) {
-	char *newPath = malloc(strlen(path) + 1);
-	strcpy(newPath, path);
-	// 
-	int lastIndex = lastIndexOf(newPath, '/');
-	newPath[lastIndex+1] = 0;	// terminate parent path
-	// make sure parent exists
-	INodeID parent = findFile(newPath);
-	free(newPath);
-	return parent;
+/**
+ * Writes out append buffers that have sat dirty for TAIL_TIMEOUT seconds,
+ * and packs the tails whose time has come. Runs in its own thread from 
+ * init until closeDisk() sets stopping.
+ */
+void *tailFlusher(void *arg) {
+	struct timespec wake;
+	INodeID id;
+	int i;
+	pthread_mutex_lock(&tailLock);
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += 1;
+		pthread_cond_timedwait(&tailCond, &tailLock, &wake);
+		for (i=0; i<NUM_TAILS && !stopping; i++) {
+			if (!tails[i].used) continue;
+			id = tails[i].id;
+			// tailLock comes after the INode locks
+			pthread_mutex_unlock(&tailLock);
+			beginOp();
+			lockINode(id, true);
+			if (refs[id].tail == i + 1 && tails[i].dirty && 
+					time(NULL) - tails[i].dirtySince >= TAIL_TIMEOUT) {
+				if (flushTail(id, &(tails[i])) != 0) log_msg("\ntailFlusher: flushing %d failed\n", id);
+			}
+			unlockINode(id);
+			endOp();
+			pthread_mutex_lock(&tailLock);
+		}
+		if (!stopping) packQueued(false);
+	}
+	pthread_mutex_unlock(&tailLock);
+	return NULL;
+}
+
+/**
+ * Starts tailFlusher. Called from init, since fuse may fork into the 
+ * background between main() and there.
+ */
+void startFlusher() {
+	stopping = false;
+	pthread_create(&flusherThread, NULL, tailFlusher, NULL);
+}
+
+/**
+ * Stops tailFlusher and writes out every append buffer that's left.
+ */
+void stopFlusher() {
+	int i;
+	pthread_mutex_lock(&tailLock);
+	stopping = true;
+	pthread_cond_signal(&tailCond);
+	pthread_mutex_unlock(&tailLock);
+	pthread_join(flusherThread, NULL);
+	for (i=0; i<NUM_TAILS; i++) {
+		if (!tails[i].used) continue;
+		beginOp();
+		releaseTail(tails[i].id, true);
+		endOp();
+	}
+	pthread_mutex_lock(&tailLock);
+	packQueued(true);
+	pthread_mutex_unlock(&tailLock);
 }
 
 /***********************************************************************
  * 
- * File allocation methods
+ * Snapshots
+ * 
+ * mkdir in /.snapshots makes a read-only copy of the whole tree there, 
+ * apart from /.snapshots itself. Directories and INodes are copied, but 
+ * each file is a clone, sharing its blocks until either side writes. 
+ * rmdir of the copy gives everything in it back.
+ * 
+ * Both walk the tree an entry at a time, each step an operation of its
+ * own, so neither outgrows a transaction, and commits go on between 
+ * them. While a snapshot is copied freezeLock keeps out every change, 
+ * so the whole tree is copied as it was at one moment; readers carry on.
+ * The copy is built out of sight and linked in at the end, and a 
+ * snapshot being dropped is unlinked first. Until either is done the 
+ * superblock names it as snapPending, and one that a crash left there is
+ * dropped at the next mount.
  * 
  ***********************************************************************/
 
-INodeID allocateFile(bool isDir) {
-	INode curNode;
-	INodeID id = allocateNextINode();
-	if (id == (INodeID) -1) {
-		errno = ENOSPC;
-		return -1;
+// an entry of a directory being copied
+typedef struct {
+	char name[sizeof(((FileEntry *) 0)->value)];
+	INodeID id;
+	bool dir;
+} SnapEntry;
+
+typedef struct {
+	SnapEntry *entries;
+	int count, size;
+} SnapList;
+
+int snapshotFill(void *ctx, const char *name, INodeID id, struct stat *statbuf, off_t next) {
+	SnapList *list = ctx;
+	if (list->count == list->size) {
+		list->size = (list->size == 0) ? 64 : list->size * 2;
+		list->entries = realloc(list->entries, list->size * sizeof(SnapEntry));
 	}
+	strcpy(list->entries[list->count].name, name);
+	list->entries[list->count].id = id;
+	list->entries[list->count].dir = S_ISDIR(statbuf->st_mode);
+	list->count++;
+	return 0;
+}
+
+/**
+ * Lists the directory dir into list, under nsLock.
+ */
+void listSnapDir(INodeID dir, SnapList *list) {
+	pthread_rwlock_rdlock(&nsLock);
+	listDir(dir, 0, snapshotFill, list);
+	pthread_rwlock_unlock(&nsLock);
+}
+
+/**
+ * Returns whether dir is /.snapshots.
+ */
+bool isSnapshotDir(INodeID dir) {
+	BlockID blk;
+	int index;
+	return dir != 0 && findFileEntry(0, SNAPSHOT_DIR, &blk, &index) == dir;
+}
+
+/**
+ * Records id in the superblock as the snapshot being taken or dropped, 0
+ * once there's none.
+ */
+void setSnapPending(INodeID id) {
+	pthread_mutex_lock(&allocLock);
+	superblock->snapPending = id;
+	writeBlock(0, superblock);
+	pthread_mutex_unlock(&allocLock);
+}
+
+/**
+ * Marks id, a copy of src, as part of a snapshot, with src's times.
+ */
+void freezeINode(INodeID id, INodeID src) {
+	INode curNode, srcNode;
+	lockINode(id, true);
+	readINode(id, &curNode);
+	readINode(src, &srcNode);
+	curNode.flags |= INODE_SNAPSHOT;
+	curNode.lastAccess = srcNode.lastAccess;
+	curNode.lastModify = srcNode.lastModify;
+	curNode.lastChange = srcNode.lastChange;
+	writeINode(id, &curNode);
+	unlockINode(id);
+}
+
+/**
+ * Copies the entry e into dir, as a frozen clone of a file or an empty
+ * directory, as an operation of its own. Sets *child to the copy, or 0 
+ * if there's none. Caller holds freezeLock for writing. Returns 0, or 
+ * -errno.
+ */
+int copyEntry(INodeID dir, SnapEntry *e, INodeID *child) {
+	int res = 0;
 	
-	BlockID blk = allocateNextBlock();
-	if (blk == (BlockID) -1) {
-		markINodeFree(id);
-		errno = ENOSPC;
-		return -1;
+	beginBulkOp();
+	pthread_rwlock_rdlock(&nsLock);
+	if ((*child = allocateFile(e->dir)) == (INodeID) -1) {
+		res = -errno;
+		*child = 0;
+	} else if (addFileEntry(dir, *child, e->name) == -1) {
+		res = -errno;
+		freeINode(*child);
+		*child = 0;
+	} else if (!e->dir) {
+		lockINodePair(*child, e->id);
+		res = cloneFile(*child, 0, e->id, 0, 0);
+		// nothing writes the copy again, so its tail can be packed now
+		if (res == 0) packTail(*child);
+		unlockINodePair(*child, e->id);
+		freezeINode(*child, e->id);
 	}
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	return res;
+}
+
+/**
+ * Copies everything in the directory src into the empty directory dir, 
+ * which nothing links to yet. Caller holds freezeLock for writing. 
+ * Returns 0, or -errno, leaving whatever was copied for the caller.
+ */
+int copyTree(INodeID src, INodeID dir) {
+	SnapList list = { NULL, 0, 0 };
+	INodeID child;
+	int i, res = 0;
 	
-	readINode(id, &curNode);
+	listSnapDir(src, &list);
+	for (i=0; i<list.count && res == 0; i++) {
+		SnapEntry *e = &(list.entries[i]);
+		if (src == 0 && strcmp(e->name, SNAPSHOT_DIR) == 0) continue;
+		res = copyEntry(dir, e, &child);
+		if (child != 0 && e->dir) {
+			if (res == 0) res = copyTree(e->id, child);
+			beginOp();
+			freezeINode(child, e->id);
+			endOp();
+		}
+	}
+	free(list.entries);
+	return res;
+}
+
+/**
+ * Gives back everything in the directory dir, which nothing links to any
+ * more. Each entry is taken out of dir in the operation that frees it, 
+ * so a crash part way leaves a smaller tree. dir itself is left to the 
+ * caller.
+ */
+void removeTree(INodeID dir) {
+	SnapList list = { NULL, 0, 0 };
 	int i;
+	listSnapDir(dir, &list);
+	for (i=0; i<list.count; i++) {
+		if (list.entries[i].dir) removeTree(list.entries[i].id);
+		// the kernel can still look up entries of a dropped snapshot
+		beginOp();
+		pthread_rwlock_wrlock(&nsLock);
+		removeFileEntry(dir, list.entries[i].name);
+		releaseINode(list.entries[i].id);
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+	}
+	free(list.entries);
+}
+
+/**
+ * Gives back the snapshot named as snapPending, if there is one. Caller
+ * holds snapLock, or is mounting.
+ */
+void dropPending() {
+	INodeID id = superblock->snapPending;
+	if (id == 0) return;
+	removeTree(id);
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	releaseINode(id);
+	setSnapPending(0);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+}
+
+/**
+ * Takes a snapshot of the whole tree as name in dir, which is /.snapshots,
+ * and sets id to it. A snapshot that can't be finished is given back. 
+ * Takes its own operations and locks, so the caller must hold none.
+ * Returns 0, or -errno.
+ */
+int takeSnapshot(INodeID dir, const char *name, INodeID *id) {
+	BlockID blk;
+	int index, res = 0;
 	
-	for (i=0; i<14; i++) {
-		curNode.blocks[i] = 0;
+	if (strlen(name) > 123) return -ENAMETOOLONG;
+	pthread_mutex_lock(&snapLock);
+	pthread_rwlock_wrlock(&freezeLock);
+	beginOp();
+	pthread_rwlock_rdlock(&nsLock);
+	if (findFileEntry(dir, name, &blk, &index) != (INodeID) -1) res = -EEXIST;
+	else if ((*id = allocateFile(true)) == (INodeID) -1) res = -errno;
+	else setSnapPending(*id);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	if (res != 0) {
+		pthread_rwlock_unlock(&freezeLock);
+		pthread_mutex_unlock(&snapLock);
+		return res;
 	}
 	
-	curNode.flags |= (isDir) ? INODE_DIR : INODE_FILE;
-	curNode.size = (isDir) ? superblock->blockSize : 0;	// set size to 0
-	curNode.childCount = 0; 				// no children in directory
-	curNode.lastAccess = time(NULL);
-	curNode.lastChange = curNode.lastAccess;
-	curNode.lastModify = curNode.lastAccess;
-	curNode.blocks[0] = blk;
-	writeINode(id, &curNode);
-	return id;
+	res = copyTree(0, *id);
+	if (res == 0) {
+		beginOp();
+		pthread_rwlock_wrlock(&nsLock);
+		if (addFileEntry(dir, *id, name) == -1) {
+			res = -errno;
+		} else {
+			freezeINode(*id, 0);
+			touchDir(dir);
+			setSnapPending(0);
+		}
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+	}
+	pthread_rwlock_unlock(&freezeLock);
+	if (res != 0) dropPending();
+	pthread_mutex_unlock(&snapLock);
+	return res;
 }
 
 /**
- * This isn't tested
- * 
- * Gets the block ID that contains the specific offset of the file. 
- * If the offset is larger than the file, returns -1
+ * Removes the snapshot name from dir, which is /.snapshots, along with 
+ * everything in it. Takes its own operations and locks, so the caller 
+ * must hold none. Returns 0, or -errno.
  */
-BlockID getBlockFromOffset(INode *node, int offset) {
-	int sizes[3];
-	int id, index;
-	int IDsPerBlock = superblock->blockSize / sizeof(BlockID);
-	BlockID *indirect;
-	// lists space (bytes) contained by each level of indirection
-	
-	sizes[0] = 12 * superblock->blockSize;
-	sizes[1] = IDsPerBlock * superblock->blockSize;
-	sizes[2] = IDsPerBlock * IDsPerBlock * superblock->blockSize;
+int dropSnapshot(INodeID dir, const char *name) {
+	BlockID blk;
+	int index, res = 0;
+	INode curNode;
+	INodeID id;
 	
-	if (offset < sizes[0]) {
-		// divide by blocksize to get which blockID contains the offset
-        log_msg("\n trying to get %d which is %d\n", offset/superblock->blockSize, 
-                node->blocks[offset / superblock->blockSize]);
-		return node->blocks[offset / superblock->blockSize];
-	} else if ((offset -= sizes[0]) < sizes[1]) {
-		// inside of the single level indirection block
-		// read indirection block
-		if (node->blocks[12] == 0) return 0;
-		indirect = malloc(superblock->blockSize);
-		readBlock(node->blocks[12], indirect);
+	pthread_mutex_lock(&snapLock);
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	if ((id = findFileEntry(dir, name, &blk, &index)) == (INodeID) -1) {
+		res = -errno;
 	} else {
-		// otherwise, the block is inside the double indirection block
-		offset -= sizes[1];
-		if (node->blocks[13] == 0) return 0;
-		indirect = malloc(superblock->blockSize);
-		// divide by how much space each first-level indirection ID takes up
-		index = offset / (IDsPerBlock * superblock->blockSize);
-		readBlock(node->blocks[13], indirect);
-		id = indirect[index];
-		if (id == 0) return 0;
-		readBlock(id, indirect);
+		readINode(id, &curNode);
+		if (!isDir((&curNode))) res = -ENOTDIR;
 	}
-	
-	index = (offset / superblock->blockSize) % (IDsPerBlock); 
-	id = indirect[index];
-	if (id == 0) {
-		log_msg("\n returning 0 and index = %d \n", index);
+	if (res == 0) {
+		removeFileEntry(dir, name);
+		touchDir(dir);
+		setSnapPending(id);
+		// everything below it goes too
+		dcacheClear();
 	}
-	free(indirect);
-	return id;
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	if (res == 0) dropPending();
+	pthread_mutex_unlock(&snapLock);
+	return res;
 }
 
 /***********************************************************************
@@ -539,10 +4527,75 @@ BlockID getBlockFromOffset(INode *node, int offset) {
  * 
  ***********************************************************************/
 
-void *sfs_init(struct fuse_conn_info *conn) {
-	conn->async_read = 0;
-	conn->max_write = superblock->blockSize;
+/**
+ * Negotiates the connection with the kernel, for either API. By default 
+ * the kernel sends one block per write and one read at a time; with 
+ * -o throughput it sends large writes, overlapping reads, and moves data 
+ * through pipes where it can.
+ */
+void initConn(struct sfs_state *data, struct fuse_conn_info *conn) {
+	mountID = findMountID(data->mountpoint);
 	conn->want = FUSE_CAP_EXPORT_SUPPORT;
+	if (!data->throughput) {
+		conn->async_read = 0;
+		conn->max_write = superblock->blockSize;
+		return;
+	}
+	conn->async_read = 1;
+	// libfuse lowers this to the size of its request buffer
+	conn->max_write = MAX_WRITE;
+	conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES | 
+		FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+/**
+ * Releases everything main() set up, for either API.
+ */
+void closeDisk(struct sfs_state *data) {
+	int i;
+	stopFlusher();
+	stopReaper();
+	stopCommitter();
+	stopDiscarder();
+	closeJournal();
+	// everything is in place, so the next mount reads nothing else
+	superblock->state |= SB_CLEAN;
+	writeBlock(0, superblock);
+	fdatasync(diskFd);
+	log_msg("\npartial block writes: %lu read first, %lu reads saved\n", rmwReads, rmwReadsSaved);
+	log_msg("clusters written: %lu compressed, %lu raw\n", packedClusters, rawClusters);
+	log_msg("blocks deduplicated: %lu\n", dedupHits);
+	log_msg("zero bytes left as holes: %lu\n", zeroBytes);
+	log_msg("blocks discarded: %lu\n", discardedBlocks);
+	fclose(data->logfile);
+	fclose(flatFile);
+	free(superblock);
+	free(bitmap);
+	free(handles);
+	free(refs);
+	for (i=0; i<NUM_TAILS; i++) {
+		free(tails[i].data);
+	}
+	free(tails);
+	free(packs);
+	free(freedTxn);
+	dcacheClear();
+	free(dcache);
+	for (i=0; i<CCACHE_SIZE; i++) {
+		free(ccache[i].data);
+	}
+	free(ccache);
+	free(data);
+}
+
+void *sfs_init(struct fuse_conn_info *conn) {
+	initConn(SFS_DATA, conn);
+	startFlusher();
+	startReaper();
+	startCommitter();
+	startDiscarder();
+	// a snapshot a crash left half taken or half dropped goes now
+	dropPending();
 	
 	log_msg("\nsfs_init()\n");
     log_conn(conn);
@@ -563,24 +4616,20 @@ int sfs_getattr(const char *path, struct stat *statbuf)
 	  path, statbuf);
 	  
 	loadGlobals();
-    INodeID id = findFile(path);
+	int retstat = 0;
     INode curNode;
-    if (id == -1) return -errno;
-	
-	readINode(id, &curNode);
-	
-	statbuf->st_mode = ((isDir((&curNode))) ? S_IFDIR : S_IFREG) | S_IRWXU | S_IRWXG | S_IRWXO;
-	statbuf->st_nlink = 1;
-	statbuf->st_ino = id;
-	statbuf->st_uid = 0;
-	statbuf->st_gid = 0;
-	statbuf->st_size = curNode.size;
-	statbuf->st_atime = curNode.lastAccess;
-	statbuf->st_mtime = curNode.lastModify;
-	statbuf->st_ctime = curNode.lastChange;
-	statbuf->st_blksize = superblock->blockSize;
-	statbuf->st_blocks = (curNode.size / 512);
-	return 0;
+	pthread_rwlock_rdlock(&nsLock);
+    INodeID id = findFile(path);
+    if (id == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		lockINode(id, false);
+		readINode(id, &curNode);
+		unlockINode(id);
+		fillStat(id, &curNode, statbuf);
+	}
+	pthread_rwlock_unlock(&nsLock);
+	return retstat;
 }
 
 /** File open operation
@@ -598,18 +4647,16 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
     log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
 
+	int retstat;
+	pthread_rwlock_rdlock(&nsLock);
     INodeID id = findFile(path);
-    if (id == (INodeID) -1) return -errno;
-    int handle = allocateNextHandle();
-    if (handle == -1) return -errno;
-    
-    handles[handle].id = id;
-    handles[handle].flags = fi->flags;
-    handles[handle].index = 0;
-    
-    fi->fh = handle;
-    
-    return 0;
+    if (id == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		retstat = openFile(id, fi, SFS_DATA->keepCache);
+	}
+	pthread_rwlock_unlock(&nsLock);
+    return retstat;
 }
 
 /**
@@ -630,28 +4677,28 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	    path, mode, fi);
 	
 	loadGlobals();
+	int retstat = 0;
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
 	INodeID id = findFile(path);
 	
     if (id == (INodeID) -1) {
 		// need to allocate file. But first, we must find the parent path
 		INodeID parent = findParent(path);
-		INode curNode;
-		if (parent == (INodeID) -1) return -errno;
-		// update parent timestamps
-		readINode(parent, &curNode);
-		curNode.lastAccess = time(NULL);
-		curNode.lastChange = curNode.lastAccess;
-		curNode.lastModify = curNode.lastAccess;
-		writeINode(parent, &curNode);
-		
-		id = allocateFile(false);
-		if (id == (INodeID) -1) return -errno;
-		// add file entry, and get the address of the start of the actual file name
-		int lastIndex = lastIndexOf(path, '/');
-		int val = addFileEntry(parent, id, &(path[lastIndex+1]));
-		if (val == -1) return -errno;
+		if (parent == (INodeID) -1) {
+			retstat = -errno;
+		} else {
+			char *name = getFileName(path);
+			retstat = makeFile(parent, name, false, &id);
+			free(name);
+		}
 	}
-	return sfs_open(path, fi);
+	if (retstat == 0) retstat = openFile(id, fi, SFS_DATA->keepCache);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	return retstat;
 }
 
 /** Create a directory */
@@ -661,115 +4708,67 @@ int sfs_mkdir(const char *path, mode_t mode)
 	    path, mode);
 	    
 	loadGlobals();
-	// directory cannot exist
-	INode curNode;
-	INodeID id = findFile(path);
-	if (id != (INodeID) -1) return -EEXIST;
-	// need to allocate file. But first, we must find the parent path
+	int retstat;
+	INodeID id;
+	// a snapshot takes its own operations and locks
+	pthread_rwlock_rdlock(&nsLock);
 	INodeID parent = findParent(path);
-	if (parent == (INodeID) -1) return -errno;
-	// update parent timestamps
-	readINode(parent, &curNode);
-	curNode.lastAccess = time(NULL);
-	curNode.lastChange = curNode.lastAccess;
-	curNode.lastModify = curNode.lastAccess;
-	writeINode(parent, &curNode);
-	log_msg("in mkdir about to allocateFile\n");
-	id = allocateFile(true);
-	log_msg("in mkdir allocated File\n");
-	if (id == (INodeID) -1) return -errno;
-	// add file entry, and get the address of the start of the actual file name
-	int lastIndex = lastIndexOf(path, '/');
-	int val = addFileEntry(parent, id, &(path[lastIndex+1]));
-	log_msg("in mkdir added file entry %d\n", val);
-	if (val == -1) return -errno;
-	
-	return 0;
+	bool snapshot = parent != (INodeID) -1 && isSnapshotDir(parent);
+	pthread_rwlock_unlock(&nsLock);
+	if (snapshot) {
+		char *name = getFileName(path);
+		retstat = takeSnapshot(parent, name, &id);
+		free(name);
+		return retstat;
+	}
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	// need to allocate directory. But first, we must find the parent path
+	parent = findParent(path);
+	if (parent == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		// fails with EEXIST if the directory already exists
+		char *name = getFileName(path);
+		retstat = makeFile(parent, name, true, &id);
+		free(name);
+	}
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	return retstat;
 }
 
 void sfs_destroy(void *userdata) {
 	log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
 	loadGlobals();
-	fclose(SFS_DATA->logfile);
-	fclose(flatFile);
-	free(superblock);
-	free(bitmap);
-	free(handles);
-	free(fuse_get_context()->private_data);
+	closeDisk(SFS_DATA);
 }
 
 /** Remove a file */
 int sfs_unlink(const char *path)
 {
-    int retstat = 0;
+    int retstat;
     log_msg("\nsfs_unlink(path\"%s\"\n",
 	    path);
 
-    INodeID id = findFile(path);
-    if (id == -1) return -errno;
-    
-    int i, j;
-    int idsPerBlock = superblock->blockSize / sizeof(BlockID);
-    BlockID *indirect1, *indirect2;
-    INode curNode;
-    
-    readINode(id, &curNode);
-    
-    if (curNode.blocks[13] != 0) {
-		indirect1 = malloc(superblock->blockSize);
-		indirect2 = malloc(superblock->blockSize);
-		readBlock(curNode.blocks[13], indirect1);
-		for (i=0; i<idsPerBlock; i++) {
-			if (indirect1[i] == 0) break;
-			readBlock(indirect1[i], indirect2);
-			for (j=0; j<idsPerBlock; j++) {
-				if (indirect2[j] == 0) break;
-				markBlockFree(indirect2[j]);
-			}
-			markBlockFree(indirect1[i]);
-		}
-		markBlockFree(curNode.blocks[13]);
-		free(indirect1);
-		free(indirect2);
-	}
-	
-	if (curNode.blocks[12] != 0) {
-		indirect1 = malloc(superblock->blockSize);
-		readBlock(curNode.blocks[12], indirect1);
-		for (i=0; i<idsPerBlock; i++) {
-			if (indirect1[i] == 0) break;
-			markBlockFree(indirect1[i]);
-		}
-		markBlockFree(curNode.blocks[12]);
-		free(indirect1);
-	}
-	
-	for (i=0; i<12; i++) {
-		if (curNode.blocks[i] == 0) break;
-		markBlockFree(curNode.blocks[i]);
-	}
-	readINode(id, &curNode);
-	memset(&curNode, 0, sizeof(INode));
-	writeINode(id, &curNode);
-	// mark INode as free
-	markINodeFree(id);
-	// get ending file name to remove it from parent directory
-	char *name, *copy;
-	name = copy = malloc(strlen(path) + 1);
-	strcpy(copy, path);
-	i = lastIndexOf(name, '/');
-	if (i == strlen(name) - 1) {
-		// remove ending slash
-		name[i] = 0;
-		i = lastIndexOf(name, '/');
-	}
-	
-	name += i + 1;
-    // remove entry from parent directory, by taking the last element
-    // of the parent directory and placing it in place of the entry being removed
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
 	INodeID parent = findParent(path);
-	removeFileEntry(parent, name);
-	free(copy);
+	if (parent == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		// get ending file name to remove it from parent directory
+		char *name = getFileName(path);
+		retstat = removeFile(parent, name, false);
+		free(name);
+	}
+	if (retstat == 0) dcacheRemove(path);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
     return retstat;
 }
 
@@ -792,6 +4791,13 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
     int retstat = 0;
     log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
+    INodeID id = handles[fi->fh].id;
+    beginOp();
+    lockINode(id, true);
+    retstat = releaseTail(id, true);
+    if (retstat == 0 && (fi->flags & O_ACCMODE) != O_RDONLY) queuePack(id);
+    unlockINode(id);
+    endOp();
     freeHandle(fi->fh);
     return retstat;
 }
@@ -809,284 +4815,298 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
  */
 int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	INode curNode;
-    int id = handles[fi->fh].id, relOffset = 0, remaining = size;
-    int blockSize = superblock->blockSize;
-    readINode(id, &curNode);
-    curNode.lastAccess = time(NULL);
-    writeINode(id, &curNode);
-    int curFileSize = curNode.size; 
-    if (offset > curFileSize) {
-         return 0;
-    }
-    int difference = 0;
-    if (size + offset > curFileSize){
-	log_msg("FIXED SIZE size before = %d FILE SIZE = %d\n", size, curFileSize);
-        difference = size + offset - curFileSize;	
-	log_msg("FIXED SIZE difference = %d \n", difference);
-	size = curFileSize - offset;
-	remaining = size;
-	log_msg("FIXED SIZE size - %d\n", size);
-    }
     log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
-    if (size == 0) {
-        log_msg("\n size = 0 returning 0 \n");
-        return 0;
-    }
-    
-    char * blockBuf = malloc(superblock->blockSize); 
-    BlockID blockToRead = getBlockFromOffset(&curNode, offset);
-    log_msg("\nAbout to read block %d\n",blockToRead);
-    readBlock(blockToRead, blockBuf);
-    int bytesToRead = min(blockSize-(offset%blockSize), remaining);
-    memcpy(buf, blockBuf + (offset % blockSize), bytesToRead);
-    remaining -= bytesToRead;
-    relOffset += bytesToRead;
-    while (remaining != 0) {
-		blockToRead = getBlockFromOffset(&curNode, offset+relOffset);
-		bytesToRead = min(blockSize, remaining);
-		readBlock(blockToRead, blockBuf);
-		memcpy(buf + (size-remaining), blockBuf, bytesToRead);
-		relOffset += bytesToRead;
-		remaining -= bytesToRead;
-    } 
-    free(blockBuf); 
-    if (difference != 0){
-       memset(buf + size, 0, difference);
-    }
-    log_msg("\nAbout to return %d", size);
-    return size;
+    INodeID id = handles[fi->fh].id;
+    int retstat, tries = 0;
+    do {
+        beginOp();
+        retstat = lockINodeFlushed(id);
+        if (retstat == 0) retstat = readFile(id, buf, size, offset);
+        unlockINode(id);
+        endOp();
+    } while (retryFreed(retstat, &tries));
+    return retstat;
 }
 
-/**
- * NEEDS TO BE TESTED UNSURE HOW TO TEST IT
- * AssignNextBlock should take in an iNode and put in another 
- * block of data into its corresponding field. It then returns
- * the blockID of the new block.
+/** Read data from an open file into a buffer vector
+ *
+ * Like read, but the data is handed back as a vector of buffers. fuse
+ * only sends it after the INode's lock is dropped, when the blocks may
+ * already belong to something else, so it can't be given segments of the
+ * image file the way the low-level API is.
+ *
+ * Introduced in version 2.9
  */
-BlockID assignNextBlock(INodeID id, INode * toAssign) {
-    int i = 0, j = 0;
-    int idsPerBlock = superblock->blockSize / sizeof(BlockID);
-    BlockID blk = allocateNextBlock(); // block we'll be assigning
-    if (blk == (BlockID) -1) return -1;
-    
-    INode curNode;
-    readINode(id, &curNode);
-    
-    //check if one of the direct blocks is free
-    for (i = 0; i <= 11; i++){
-        if (curNode.blocks[i] == 0) {
-            curNode.blocks[i] = blk;
-            toAssign->blocks[i] = blk;
-            log_msg("\n giving inode %d blk %d in spot %d \n", id, blk, i);
-            writeINode(id, &curNode);
-            return blk;
-		} 
-    }
-    
-    //allocate a first level indirection if neccessary
-    if (curNode.blocks[12] == 0) {
-        curNode.blocks[12] = blk;
-        toAssign->blocks[12] = blk;
-    	blk = allocateNextBlock();
-    	if (blk == (BlockID) -1) {
-			// free first indirection block 
-			markBlockFree(curNode.blocks[12]);
-			return -1;
-		} else {
-			// write indirection right here & write 0's to the rest of the block
-			BlockID *block = calloc(superblock->blockSize, 1);
-			block[0] = blk;
-			writeBlock(curNode.blocks[12], block);	// write block back
-			writeINode(id, &curNode);
-			free(block);
-			return blk;
-		}
-    }
-    
-    BlockID *indirect1 = malloc(superblock->blockSize);
-    //look for first free spot in first level indirection
-    readBlock(curNode.blocks[12], indirect1); 
-    for (i=0; i<idsPerBlock; i++) {
-        if (indirect1[i] == 0) {
-			// write to this slot
-			indirect1[i] = blk;
-			writeBlock(curNode.blocks[12], indirect1);
-			free(indirect1);
-			return blk;
+int sfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, 
+		struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_read_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, size, offset, fi);
+    INodeID id = handles[fi->fh].id;
+    int retstat, tries = 0;
+    do {
+        beginOp();
+        retstat = lockINodeFlushed(id);
+        if (retstat == 0) retstat = readFileBuf(id, bufp, size, offset);
+        if (retstat >= 0 && copyBufVec(*bufp) != 0) {
+			freeBufVec(*bufp);
+			*bufp = NULL;
+			retstat = -ENOMEM;
 		}
-    }
-    // at this point, indirect1 is still allocated
-    //allocate a second level indirection if neccessary
-    if (curNode.blocks[13] == 0){
-        curNode.blocks[13] = blk;
-        toAssign->blocks[13] = blk;
-        blk = allocateNextBlock();
-        if (blk == (BlockID) -1) {
-			// free blocks that may have been allocated
-			markBlockFree(curNode.blocks[13]);
-			free(indirect1);
-			return -1;
-		}
-		// clear block
-		memset(indirect1, 0, superblock->blockSize);
-        writeBlock(curNode.blocks[13], indirect1);	// write 0's to block
-        writeINode(id, &curNode);
-    }
+        unlockINode(id);
+        endOp();
+    } while (retryFreed(retstat, &tries));
+    return retstat;
+}
+
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.  An exception to this is when the 'direct_io'
+ * mount option is specified (see read operation).
+ *
+ * Changed in version 2.2
+ */
+int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    INodeID id = handles[fi->fh].id;
+    int retstat, tries = 0;
+    beginChange();
+    do {
+        beginBulkOp();
+        lockINode(id, true);
+        retstat = writeFile(id, buf, size, offset);
+        unlockINode(id);
+        endOp();
+    } while (retryFreed(retstat, &tries));
+    endChange();
+    return retstat;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer, which may be a pipe fuse spliced the data into.
+ * Whole blocks go straight from it into the image.
+ *
+ * Introduced in version 2.9
+ */
+int sfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, 
+		struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_write_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n", 
+	    path, fuse_buf_size(buf), offset, fi);
+    INodeID id = handles[fi->fh].id;
+    size_t idx = buf->idx, off = buf->off;
+    int retstat, tries = 0;
+    beginChange();
+    do {
+        beginBulkOp();
+        lockINode(id, true);
+        retstat = writeFileBuf(id, buf, offset);
+        unlockINode(id);
+        endOp();
+    } while (retstat == -ENOSPC && rewindBufVec(buf, idx, off) && retryFreed(retstat, &tries));
+    endChange();
+    return retstat;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
+    return syncFile(handles[fi->fh].id, datasync != 0);
+}
+
+/** Change the size of a file */
+int sfs_truncate(const char *path, off_t newsize)
+{
+    int retstat, tries = 0;
+    log_msg("\nsfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
     
-    BlockID *indirect2 = malloc(superblock->blockSize);
-    // read first indirection block
-    readBlock(curNode.blocks[13], indirect1); 
-    for (i=0; i<idsPerBlock; i++) {
-		if (indirect1[i] == 0) {
-			// need to allocate an indirection block
-			indirect1[i] = blk;
-			blk = allocateNextBlock();
-			if (blk == (BlockID) -1) {
-				markBlockFree(indirect1[i]);
-				free(indirect1);
-				free(indirect2);
-				return -1;
-			}
-			writeBlock(curNode.blocks[13], indirect1);
-			memset(indirect2, 0, superblock->blockSize);
-			writeBlock(indirect1[i], indirect2);	// write 0's to block
-		}
-		
-		readBlock(indirect1[i], indirect2);
-		for (j=0; j<idsPerBlock; j++) {
-			if (indirect2[j] == 0) {
-				indirect2[j] = blk;
-				writeBlock(indirect1[i], indirect2);
-				free(indirect1);
-				free(indirect2);
-				return blk;
-			}
+	beginChange();
+	do {
+		beginBulkOp();
+		pthread_rwlock_rdlock(&nsLock);
+		INodeID id = findFile(path);
+		if (id == (INodeID) -1) {
+			retstat = -errno;
+		} else {
+			lockINode(id, true);
+			retstat = truncateFile(id, newsize);
+			unlockINode(id);
 		}
-    }
-    free(indirect1);
-	free(indirect2);
-    //well shit thats a big file
-    return -1;
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+	} while (retryFreed(retstat, &tries));
+	endChange();
+    return retstat;
 }
-/** Write data to an open file
+
+/**
+ * Change the size of an open file
  *
- * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
+ * Introduced in version 2.5
+ */
+int sfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n", path, offset, fi);
+    INodeID id = handles[fi->fh].id;
+    int retstat, tries = 0;
+    beginChange();
+    do {
+        beginBulkOp();
+        lockINode(id, true);
+        retstat = truncateFile(id, offset);
+        unlockINode(id);
+        endOp();
+    } while (retryFreed(retstat, &tries));
+    endChange();
+    return retstat;
+}
+
+/**
+ * Allocates space for an open file
  *
- * Changed in version 2.2
+ * Also punches holes, with FALLOC_FL_PUNCH_HOLE.
+ *
+ * Introduced in version 2.9.1
  */
-int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+int sfs_fallocate(const char *path, int mode, off_t offset, off_t length, 
+		struct fuse_file_info *fi)
 {
-    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
-    int id = handles[fi->fh].id, written = 0;
-    INode curNode;
-    readINode(id, &curNode);
-    if (offset >  curNode.size){
-        char * zeroBuf = calloc(offset - curNode.size, 1);
-        log_msg("\n re calling write, zeroBuf size = %d", offset - curNode.size);
-        sfs_write(path,zeroBuf, offset-curNode.size, curNode.size, fi);
-        readINode(id, &curNode);
-    }
-    log_msg("\ninode %d block 0 = %d block 1 = %d\n", id, curNode.blocks[0],
-            curNode.blocks[1]);
-    BlockID firstHalf = getBlockFromOffset(&curNode, offset);
-    if (firstHalf == 0) {
-        firstHalf = assignNextBlock(id, &curNode);
-        if (firstHalf == (BlockID) -1) return -errno;	// ran out of space
-		log_msg("\nassigning new block %d\n", firstHalf);
-    }
-    log_msg("\nAFTER inode %d block 0 = %d block 1 = %d\n", id, curNode.blocks[0],
-            curNode.blocks[1]);
-    char * blockBuf = malloc(superblock->blockSize);
-    readBlock(firstHalf, blockBuf);
-    int blocksize = superblock->blockSize;
-    int toWrite = min(blocksize - (offset % blocksize), (int) size);
-    memcpy(blockBuf+(offset % blocksize), buf, toWrite);
-    writeBlock(firstHalf, blockBuf);
-    log_msg("\nWrote %d to block %d", toWrite, firstHalf);
-    written += toWrite;
-    while (written != size) {
-        toWrite = min(blocksize, size - written);    
-        //check if INode exists in the next space (it shouldn't but worth checking)
-        BlockID blockToWrite = getBlockFromOffset(&curNode, offset+written);
-		if (blockToWrite == 0) {
-			blockToWrite = assignNextBlock(id, &curNode);
-			if (blockToWrite == (BlockID) -1) {
-				// ran out of space
-				free(blockBuf);
-				return -errno;
-			}
-		}
-    	log_msg("\nAbout to write %d to block %d", toWrite, blockToWrite);
-    	readBlock(blockToWrite, blockBuf);
-        memcpy(blockBuf, buf+written, toWrite);
-        writeBlock(blockToWrite, blockBuf);
-		written += toWrite;
-        //if so start writting to that
-        //else assignanewblock to the inode and write to that
-	//increase written by toWrite
-    }
-    log_msg("\nAbout to return %d", written);
-    if (offset >= curNode.size){
-        log_msg("\n Increased file size by %d\n", written + offset);
-        curNode.size = written + offset;
-    }
-    else {
-        int toAdd = max(0, (int) size + offset - curNode.size);    
-        log_msg("\n 2 Increased file size by %d\n", toAdd);
-        curNode.size += toAdd;
-    }
-    curNode.lastAccess = time(NULL);
-	curNode.lastChange = curNode.lastAccess;
-	curNode.lastModify = curNode.lastAccess;
-    writeINode(id, &curNode);
-    return written;
+    log_msg("\nsfs_fallocate(path=\"%s\", mode=0x%x, offset=%lld, length=%lld, fi=0x%08x)\n", 
+	    path, mode, offset, length, fi);
+    INodeID id = handles[fi->fh].id;
+    int retstat, tries = 0;
+    beginChange();
+    do {
+        beginBulkOp();
+        lockINode(id, true);
+        retstat = allocateFileRange(id, mode, offset, length);
+        unlockINode(id);
+        endOp();
+    } while (retryFreed(retstat, &tries));
+    endChange();
+    return retstat;
+}
+
+/**
+ * Ioctl
+ *
+ * Only SFS_IOC_CLONE, since the kernel keeps FICLONE and 
+ * copy_file_range to itself. See cloneRange().
+ *
+ * Introduced in version 2.8
+ */
+int sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, 
+		unsigned int flags, void *data)
+{
+    log_msg("\nsfs_ioctl(path=\"%s\", cmd=0x%x, fi=0x%08x)\n", path, cmd, fi);
+    if (cmd != SFS_IOC_CLONE) return -ENOTTY;
+    return cloneRange(handles[fi->fh].id, data, fuse_get_context()->pid);
 }
 
 /** Remove a directory */
 int sfs_rmdir(const char *path)
 {
-    int i, id;
+    int retstat;
     log_msg("sfs_rmdir(path=\"%s\")\n",
 	    path);
-    // ensure file exists
-    id = findFile(path);
-    if (id == -1) return -errno;
-    INode curNode;
-    readINode(id, &curNode);
-    // directory needs to be empty
-    if (curNode.childCount > 0) return -ENOTEMPTY;
-    // free all data blocks connected to INode
-    for (i=0; i<curNode.size / superblock->blockSize; i++) {
-		markBlockFree(curNode.blocks[i]);
+	
+	// dropping a snapshot takes its own operations and locks
+	pthread_rwlock_rdlock(&nsLock);
+	INodeID parent = findParent(path);
+	bool snapshot = parent != (INodeID) -1 && isSnapshotDir(parent);
+	pthread_rwlock_unlock(&nsLock);
+	if (snapshot) {
+		char *name = getFileName(path);
+		retstat = dropSnapshot(parent, name);
+		free(name);
+		return retstat;
 	}
-	// mark INode as free
-	markINodeFree(id);
-	// get ending file name to remove it from parent directory
-	char *name, *copy;
-	name = copy = malloc(strlen(path) + 1);
-	strcpy(copy, path);
-	i = lastIndexOf(name, '/');
-	if (i == strlen(name) - 1) {
-		// remove ending slash
-		name[i] = 0;
-		i = lastIndexOf(name, '/');
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	parent = findParent(path);
+	if (parent == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		// get ending file name to remove it from parent directory
+		char *name = getFileName(path);
+		retstat = removeFile(parent, name, true);
+		if (retstat == 0) dcacheRemove(path);
+		free(name);
 	}
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+    return retstat;
+}
+
+/** Rename a file
+ *
+ * Only directory entries move, see moveFile(). An existing file at 
+ * newpath is replaced.
+ */
+int sfs_rename(const char *path, const char *newpath)
+{
+	log_msg("\nsfs_rename(path=\"%s\", newpath=\"%s\")\n",
+		path, newpath);
 	
-	name += i + 1;
-    // remove entry from parent directory, by taking the last element
-    // of the parent directory and placing it in place of the entry being removed
+	loadGlobals();
+	INode curNode;
+	int retstat, len = dcacheKeyLen(path);
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	INodeID id = findFile(path);
 	INodeID parent = findParent(path);
-	removeFileEntry(parent, name);
-	free(copy);
-    return 0;
+	INodeID newParent = findParent(newpath);
+	if (id == (INodeID) -1 || parent == (INodeID) -1 || newParent == (INodeID) -1) {
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+		endChange();
+		return -errno;
+	}
+	
+	readINode(id, &curNode);
+	if (isDir((&curNode)) && strncmp(path, newpath, len) == 0 && newpath[len] == '/') {
+		// a directory can't be moved inside of itself
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+		endChange();
+		return -EINVAL;
+	}
+	
+	char *name = getFileName(path);
+	char *newName = getFileName(newpath);
+	retstat = moveFile(parent, name, newParent, newName);
+	free(name);
+	free(newName);
+	
+	if (retstat == 0 && isDir((&curNode))) {
+		// everything below the directory has a new path
+		dcacheClear();
+	} else if (retstat == 0) {
+		dcacheRemove(path);
+		dcacheRemove(newpath);
+	}
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	return retstat;
 }
 
-
 /** Open directory
  *
  * This method should check if the open operation is permitted for
@@ -1125,43 +5145,52 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
+struct readdirCtx {
+	void *buf;
+	fuse_fill_dir_t filler;
+	char *childPath;
+	int pathLen;
+};
+
+int readdirFill(void *ctx, const char *name, INodeID id, struct stat *statbuf, off_t next) {
+	struct readdirCtx *dir = ctx;
+	// prime the lookup cache for the getattr calls that follow a listing
+	strcpy(dir->childPath + dir->pathLen, name);
+	dcacheInsert(dir->childPath, id);
+	return dir->filler(dir->buf, name, statbuf, 0);
+}
+
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
 	log_msg("\nsfs_readdir()\n");
 	loadGlobals();
-    BlockID blk = 0;
-	int i, count, remaining, entriesPerBlock;
-	FileEntry *ptr;
-	FileEntry *entries = malloc(superblock->blockSize);
+	int retstat;
+	struct readdirCtx ctx;
+	INodeID id;
 
-	i = findFile(path);
-	if (i == -1) return -errno;
+	pthread_rwlock_rdlock(&nsLock);
+	id = findFile(path);
+	if (id == (INodeID) -1) {
+		pthread_rwlock_unlock(&nsLock);
+		return -errno;
+	}
 	
-	INode curNode;
-	readINode(i, &curNode);
-	remaining = curNode.childCount;
-	entriesPerBlock = superblock->blockSize / sizeof(FileEntry);
+	// room for "path/name"
+	ctx.buf = buf;
+	ctx.filler = filler;
+	ctx.pathLen = dcacheKeyLen(path);
+	ctx.childPath = malloc(ctx.pathLen + sizeof(FileEntry) + 1);
+	memcpy(ctx.childPath, path, ctx.pathLen);
+	if (ctx.pathLen == 1) ctx.pathLen = 0;	// listing root, don't double the '/'
+	ctx.childPath[ctx.pathLen++] = '/';
 	
-	// each iteration will read 1 block of data
-	while (remaining > 0) {
-		// read next block
-		readBlock(curNode.blocks[blk++], entries);
-		// read the remaining number of entries, or the whole blocks worth of entities
-		count = min(remaining, entriesPerBlock);
-		remaining -= count;
-		
-		for (i=0; i<count; i++) {
-			// iterate through each entry
-			ptr = &(entries[i]);
-			if (filler(buf, ptr->value, NULL, 0) != 0) {
-				free(entries);
-				return -ENOMEM;
-			}
-		}
-	}
-	free(entries);
-    return 0;
+	// the whole directory is listed in one call, so a full buffer is an error
+	retstat = listDir(id, 0, readdirFill, &ctx);
+	if (retstat == 1) retstat = -ENOMEM;
+	pthread_rwlock_unlock(&nsLock);
+	free(ctx.childPath);
+    return retstat;
 }
 
 /** Release directory
@@ -1183,10 +5212,18 @@ struct fuse_operations sfs_oper = {
   .getattr = sfs_getattr,
   .create = sfs_create,
   .unlink = sfs_unlink,
+  .rename = sfs_rename,
+  .truncate = sfs_truncate,
+  .ftruncate = sfs_ftruncate,
   .open = sfs_open,
   .release = sfs_release,
   .read = sfs_read,
+  .read_buf = sfs_read_buf,
   .write = sfs_write,
+  .write_buf = sfs_write_buf,
+  .fsync = sfs_fsync,
+  .fallocate = sfs_fallocate,
+  .ioctl = sfs_ioctl,
 
   .rmdir = sfs_rmdir,
   .mkdir = sfs_mkdir,
@@ -1196,22 +5233,571 @@ struct fuse_operations sfs_oper = {
   .releasedir = sfs_releasedir
 };
 
+/***********************************************************************
+ * 
+ * Low-level SFS Methods
+ * 
+ * The same operations as above for fuse_lowlevel, where the kernel hands
+ * us INode numbers instead of paths. Paths are only ever resolved one
+ * component at a time, by lookup.
+ * 
+ ***********************************************************************/
+
+# define SFS_LL_DATA(req) ((struct sfs_state *) fuse_req_userdata(req))
+
+/**
+ * Fills e with the attributes of id, and hands the kernel a reference to
+ * it. Caller holds nsLock, so the entry can't go away in between.
+ */
+void lookupINode(fuse_req_t req, INodeID id, INodeID parent, struct fuse_entry_param *e) {
+	INode curNode;
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	lockINode(id, false);
+	readINode(id, &curNode);
+	unlockINode(id);
+	fillStat(id, &curNode, &(e->attr));
+	e->ino = toIno(id);
+	e->attr_timeout = SFS_LL_DATA(req)->attrTimeout;
+	e->entry_timeout = SFS_LL_DATA(req)->entryTimeout;
+	refINode(id, parent);
+}
+
+void sfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	initConn(userdata, conn);
+	startFlusher();
+	startReaper();
+	startCommitter();
+	startDiscarder();
+	// a snapshot a crash left half taken or half dropped goes now
+	dropPending();
+	log_msg("\nsfs_ll_init()\n");
+	log_conn(conn);
+}
+
+void sfs_ll_destroy(void *userdata) {
+	log_msg("\nsfs_ll_destroy(userdata=0x%08x)\n", userdata);
+	closeDisk(userdata);
+}
+
+void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct fuse_entry_param e;
+	BlockID blk;
+	int index, err;
+	log_msg("\nsfs_ll_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+	
+	pthread_rwlock_rdlock(&nsLock);
+	INodeID id = findFileEntry(fromIno(parent), name, &blk, &index);
+	if (id == (INodeID) -1) {
+		err = errno;
+		pthread_rwlock_unlock(&nsLock);
+		fuse_reply_err(req, err);
+		return;
+	}
+	lookupINode(req, id, fromIno(parent), &e);
+	pthread_rwlock_unlock(&nsLock);
+	fuse_reply_entry(req, &e);
+}
+
+void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	log_msg("\nsfs_ll_forget(ino=%lu, nlookup=%lu)\n", ino, nlookup);
+	forgetINode(fromIno(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+void sfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	size_t i;
+	log_msg("\nsfs_ll_forget_multi(count=%d)\n", count);
+	for (i=0; i<count; i++) {
+		forgetINode(fromIno(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	INode curNode;
+	struct stat statbuf;
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_getattr(ino=%lu)\n", ino);
+	
+	lockINode(id, false);
+	readINode(id, &curNode);
+	unlockINode(id);
+	fillStat(id, &curNode, &statbuf);
+	fuse_reply_attr(req, &statbuf, SFS_LL_DATA(req)->attrTimeout);
+}
+
+/**
+ * Only the size and timestamps can be changed; ownership and permissions 
+ * are fixed for every file in sfs.
+ */
+void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, 
+		struct fuse_file_info *fi) {
+	INode curNode;
+	struct stat statbuf;
+	INodeID id = fromIno(ino);
+	int retstat = 0, tries = 0;
+	log_msg("\nsfs_ll_setattr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+	
+	beginChange();
+	do {
+		if (to_set & FUSE_SET_ATTR_SIZE) beginBulkOp();
+		else beginOp();
+		lockINode(id, true);
+		if (to_set & FUSE_SET_ATTR_SIZE) retstat = truncateFile(id, attr->st_size);
+		if (retstat == 0) break;
+		unlockINode(id);
+		endOp();
+	} while (retryFreed(retstat, &tries));
+	if (retstat != 0) {
+		endChange();
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	// still in the operation, holding the INode's lock
+	readINode(id, &curNode);
+	if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) && (curNode.flags & INODE_SNAPSHOT)) {
+		unlockINode(id);
+		endOp();
+		endChange();
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		if (to_set & FUSE_SET_ATTR_ATIME) {
+			curNode.lastAccess = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+		}
+		if (to_set & FUSE_SET_ATTR_MTIME) {
+			curNode.lastModify = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+		}
+		curNode.lastChange = time(NULL);
+		writeINode(id, &curNode);
+	}
+	unlockINode(id);
+	endOp();
+	endChange();
+	fillStat(id, &curNode, &statbuf);
+	fuse_reply_attr(req, &statbuf, SFS_LL_DATA(req)->attrTimeout);
+}
+
+void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, 
+		struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+	INodeID id;
+	log_msg("\nsfs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
+	
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	int retstat = makeFile(fromIno(parent), name, false, &id);
+	if (retstat == 0) retstat = openFile(id, fi, SFS_LL_DATA(req)->keepCache);
+	if (retstat == 0) lookupINode(req, id, fromIno(parent), &e);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	
+	if (retstat != 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_create(req, &e, fi);
+	}
+}
+
+void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	struct fuse_entry_param e;
+	INodeID id;
+	log_msg("\nsfs_ll_mkdir(parent=%lu, name=\"%s\", mode=0%03o)\n", parent, name, mode);
+	
+	BlockID blk;
+	int index, retstat = 0;
+	// a snapshot takes its own operations and locks
+	pthread_rwlock_rdlock(&nsLock);
+	bool snapshot = isSnapshotDir(fromIno(parent));
+	pthread_rwlock_unlock(&nsLock);
+	if (snapshot) retstat = takeSnapshot(fromIno(parent), name, &id);
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	if (!snapshot) retstat = makeFile(fromIno(parent), name, true, &id);
+	// a snapshot could have been dropped again already
+	else if (retstat == 0 && findFileEntry(fromIno(parent), name, &blk, &index) != id) retstat = -ENOENT;
+	if (retstat == 0) lookupINode(req, id, fromIno(parent), &e);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	
+	if (retstat != 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_msg("\nsfs_ll_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	int retstat = removeFile(fromIno(parent), name, false);
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	fuse_reply_err(req, -retstat);
+}
+
+void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	log_msg("\nsfs_ll_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+	int retstat;
+	// dropping a snapshot takes its own operations and locks
+	pthread_rwlock_rdlock(&nsLock);
+	bool snapshot = isSnapshotDir(fromIno(parent));
+	pthread_rwlock_unlock(&nsLock);
+	if (snapshot) {
+		retstat = dropSnapshot(fromIno(parent), name);
+	} else {
+		beginChange();
+		beginOp();
+		pthread_rwlock_wrlock(&nsLock);
+		retstat = removeFile(fromIno(parent), name, true);
+		pthread_rwlock_unlock(&nsLock);
+		endOp();
+		endChange();
+	}
+	fuse_reply_err(req, -retstat);
+}
+
+void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, 
+		fuse_ino_t newparent, const char *newname) {
+	INode curNode;
+	BlockID blk;
+	int index, retstat = 0, depth;
+	INodeID dir;
+	log_msg("\nsfs_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\")\n", 
+		parent, name, newparent, newname);
+	
+	beginChange();
+	beginOp();
+	pthread_rwlock_wrlock(&nsLock);
+	INodeID id = findFileEntry(fromIno(parent), name, &blk, &index);
+	if (id == (INodeID) -1) {
+		retstat = -errno;
+	} else {
+		readINode(id, &curNode);
+	}
+	if (retstat == 0 && isDir((&curNode))) {
+		// a directory can't be moved inside of itself. Every directory the
+		// kernel can name was looked up, so walk up through those parents
+		dir = fromIno(newparent);
+		for (depth = 0; dir != 0 && depth < superblock->numINodes; depth++) {
+			if (dir == id) {
+				retstat = -EINVAL;
+				break;
+			}
+			dir = refs[dir].parent;
+		}
+	}
+	if (retstat == 0) retstat = moveFile(fromIno(parent), name, fromIno(newparent), newname);
+	if (retstat == 0) {
+		pthread_mutex_lock(&refLock);
+		refs[id].parent = fromIno(newparent);
+		pthread_mutex_unlock(&refLock);
+	}
+	pthread_rwlock_unlock(&nsLock);
+	endOp();
+	endChange();
+	fuse_reply_err(req, -retstat);
+}
+
+void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nsfs_ll_open(ino=%lu)\n", ino);
+	int retstat = openFile(fromIno(ino), fi, SFS_LL_DATA(req)->keepCache);
+	if (retstat != 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_open(req, fi);
+	}
+}
+
+void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_release(ino=%lu)\n", ino);
+	beginOp();
+	lockINode(id, true);
+	int retstat = releaseTail(id, true);
+	if (retstat == 0 && (fi->flags & O_ACCMODE) != O_RDONLY) queuePack(id);
+	unlockINode(id);
+	endOp();
+	freeHandle(fi->fh);
+	fuse_reply_err(req, -retstat);
+}
+
+void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, 
+		struct fuse_file_info *fi) {
+	struct fuse_bufvec *bufv;
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_read(ino=%lu, size=%d, off=%lld)\n", ino, size, off);
+	
+	// the reply goes out before the lock is dropped, so the blocks can't
+	// be reused while fuse is still moving them
+	int retstat, tries = 0;
+	do {
+		beginOp();
+		if ((retstat = lockINodeFlushed(id)) == 0) break;
+		unlockINode(id);
+		endOp();
+	} while (retryFreed(retstat, &tries));
+	if (retstat != 0) {
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	retstat = readFileBuf(id, &bufv, size, off);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+		freeBufVec(bufv);
+	}
+	unlockINode(id);
+	endOp();
+}
+
+void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, 
+		struct fuse_file_info *fi) {
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_write(ino=%lu, size=%d, off=%lld)\n", ino, size, off);
+	
+	int retstat, tries = 0;
+	beginChange();
+	do {
+		beginBulkOp();
+		lockINode(id, true);
+		retstat = writeFile(id, buf, size, off);
+		unlockINode(id);
+		endOp();
+	} while (retryFreed(retstat, &tries));
+	endChange();
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_write(req, retstat);
+	}
+}
+
+void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, 
+		struct fuse_file_info *fi) {
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_write_buf(ino=%lu, size=%d, off=%lld)\n", ino, fuse_buf_size(bufv), off);
+	
+	size_t idx = bufv->idx, bufOff = bufv->off;
+	int retstat, tries = 0;
+	beginChange();
+	do {
+		beginBulkOp();
+		lockINode(id, true);
+		retstat = writeFileBuf(id, bufv, off);
+		unlockINode(id);
+		endOp();
+	} while (retstat == -ENOSPC && rewindBufVec(bufv, idx, bufOff) && retryFreed(retstat, &tries));
+	endChange();
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_write(req, retstat);
+	}
+}
+
+void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	log_msg("\nsfs_ll_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
+	fuse_reply_err(req, -syncFile(fromIno(ino), datasync != 0));
+}
+
+void sfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, 
+		struct fuse_file_info *fi) {
+	INodeID id = fromIno(ino);
+	log_msg("\nsfs_ll_fallocate(ino=%lu, mode=0x%x, offset=%lld, length=%lld)\n", 
+		ino, mode, offset, length);
+	int retstat, tries = 0;
+	beginChange();
+	do {
+		beginBulkOp();
+		lockINode(id, true);
+		retstat = allocateFileRange(id, mode, offset, length);
+		unlockINode(id);
+		endOp();
+	} while (retryFreed(retstat, &tries));
+	endChange();
+	fuse_reply_err(req, -retstat);
+}
+
+void sfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, 
+		unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+	log_msg("\nsfs_ll_ioctl(ino=%lu, cmd=0x%x)\n", ino, cmd);
+	if (cmd != SFS_IOC_CLONE || in_bufsz < sizeof(CloneRange)) {
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+	int retstat = cloneRange(fromIno(ino), in_buf, fuse_req_ctx(req)->pid);
+	if (retstat != 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_ioctl(req, 0, NULL, 0);
+	}
+}
+
+void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nsfs_ll_opendir(ino=%lu)\n", ino);
+	fuse_reply_open(req, fi);
+}
+
+struct llDirBuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size, used;
+};
+
+int llReaddirFill(void *ctx, const char *name, INodeID id, struct stat *statbuf, off_t next) {
+	struct llDirBuf *dir = ctx;
+	size_t len = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+	// stop once the kernel's buffer is full, it will ask again from next
+	if (dir->used + len > dir->size) return 1;
+	fuse_add_direntry(dir->req, dir->buf + dir->used, dir->size - dir->used, name, statbuf, next);
+	dir->used += len;
+	return 0;
+}
+
+void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, 
+		struct fuse_file_info *fi) {
+	struct llDirBuf dir;
+	log_msg("\nsfs_ll_readdir(ino=%lu, size=%d, off=%lld)\n", ino, size, off);
+	
+	dir.req = req;
+	dir.buf = malloc(size);
+	dir.size = size;
+	dir.used = 0;
+	pthread_rwlock_rdlock(&nsLock);
+	int retstat = listDir(fromIno(ino), off, llReaddirFill, &dir);
+	pthread_rwlock_unlock(&nsLock);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_buf(req, dir.buf, dir.used);
+	}
+	free(dir.buf);
+}
+
+void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	log_msg("\nsfs_ll_releasedir(ino=%lu)\n", ino);
+	fuse_reply_err(req, 0);
+}
+
+struct fuse_lowlevel_ops sfs_ll_oper = {
+  .init = sfs_ll_init,
+  .destroy = sfs_ll_destroy,
+  
+  .lookup = sfs_ll_lookup,
+  .forget = sfs_ll_forget,
+  .forget_multi = sfs_ll_forget_multi,
+  .getattr = sfs_ll_getattr,
+  .setattr = sfs_ll_setattr,
+  .create = sfs_ll_create,
+  .unlink = sfs_ll_unlink,
+  .rename = sfs_ll_rename,
+  .open = sfs_ll_open,
+  .release = sfs_ll_release,
+  .read = sfs_ll_read,
+  .write = sfs_ll_write,
+  .write_buf = sfs_ll_write_buf,
+  .fsync = sfs_ll_fsync,
+  .fallocate = sfs_ll_fallocate,
+  .ioctl = sfs_ll_ioctl,
+  
+  .rmdir = sfs_ll_rmdir,
+  .mkdir = sfs_ll_mkdir,
+  
+  .opendir = sfs_ll_opendir,
+  .readdir = sfs_ll_readdir,
+  .releasedir = sfs_ll_releasedir
+};
+
+/**
+ * Mounts and runs the low-level session, in place of fuse_main().
+ */
+int sfs_ll_main(struct fuse_args *args, struct sfs_state *sfs_data) {
+	char *mountpoint;
+	int multithreaded, foreground, err = -1;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+	ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), sfs_data);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = (multithreaded) ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return (err) ? 1 : 0;
+}
+
 void sfs_usage()
 {
     fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "        sfs --sparsify diskFile\n");
+    fprintf(stderr, "\nsfs options:\n");
+    fprintf(stderr, "    -o lowlevel            use the inode based low-level FUSE API\n");
+    fprintf(stderr, "    -o throughput          large writes, async reads and splice\n");
+    fprintf(stderr, "    -o attr_timeout=T      cache attributes for T seconds (1.0)\n");
+    fprintf(stderr, "    -o entry_timeout=T     cache names for T seconds (1.0)\n");
+    fprintf(stderr, "    -o keep_cache          keep file pages cached across opens\n");
+    fprintf(stderr, "    -o relatime            write atime only when stale (default)\n");
+    fprintf(stderr, "    -o strictatime         write atime on every read\n");
+    fprintf(stderr, "    -o noatime             never write atime on read\n");
+    fprintf(stderr, "    -o compress            compress the data of new files\n");
+    fprintf(stderr, "    -o dedup               deduplicate the blocks of new files\n");
+    fprintf(stderr, "    -o discard             punch freed blocks out of diskFile\n");
+    fprintf(stderr, "\n--sparsify punches every free block out of an unmounted diskFile.\n");
     abort();
 }
 
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+struct fuse_opt sfs_opts[] = {
+	SFS_OPT("lowlevel", lowLevel, 1),
+	SFS_OPT("throughput", throughput, 1),
+	SFS_OPT("attr_timeout=%lf", attrTimeout, 0),
+	SFS_OPT("entry_timeout=%lf", entryTimeout, 0),
+	SFS_OPT("keep_cache", keepCache, 1),
+	SFS_OPT("relatime", atimeMode, ATIME_RELATIME),
+	SFS_OPT("strictatime", atimeMode, ATIME_STRICT),
+	SFS_OPT("noatime", atimeMode, ATIME_NOATIME),
+	SFS_OPT("compress", compress, 1),
+	SFS_OPT("dedup", dedup, 1),
+	SFS_OPT("discard", discard, 1),
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
     int fuse_stat;
     struct sfs_state *sfs_data;
     
+    // sfs --sparsify works on an unmounted image, then exits
+    if ((argc == 3) && (strcmp(argv[1], "--sparsify") == 0))
+	return sparsifyImage(argv[2]);
+
     // sanity checking on the command line
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	sfs_usage();
 
-    sfs_data = malloc(sizeof(struct sfs_state));
+    sfs_data = calloc(sizeof(struct sfs_state), 1);
     if (sfs_data == NULL) {
 		perror("main calloc");
 		abort();
@@ -1222,6 +5808,8 @@ int main(int argc, char *argv[])
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
+    // as /proc/self/mountinfo will show it, see findMountID()
+    sfs_data->mountpoint = realpath(argv[argc-1], NULL);
     
     sfs_data->logfile = log_open();
     //******************************************************************/
@@ -1245,14 +5833,32 @@ int main(int argc, char *argv[])
 		fwrite((void *) &nothing, 1, 1, flatFile);
 		fflush(flatFile);
 	}
+	for (i=0; i<INODE_LOCKS; i++) {
+		pthread_rwlock_init(&(inodeLocks[i]), NULL);
+	}
+	// a waiting commit holds off new operations, and a waiting snapshot
+	// new changes, or either could starve
+	pthread_rwlockattr_t txnAttr;
+	pthread_rwlockattr_init(&txnAttr);
+	pthread_rwlockattr_setkind_np(&txnAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&txnLock, &txnAttr);
+	pthread_rwlock_init(&freezeLock, &txnAttr);
+	pthread_rwlockattr_destroy(&txnAttr);
 	// read superblock
 	superblock = calloc(BLOCK_SIZE, 1);
 	bitmap = calloc(BLOCK_SIZE, 1);
-	fseek(flatFile, 0, SEEK_SET);
-	fread(superblock, BLOCK_SIZE, 1, flatFile);
+	// everything from here on goes through the descriptor
+	diskFd = fileno(flatFile);
+	pread(diskFd, superblock, BLOCK_SIZE, 0);
+	if (validSuperBlock(superblock) && !(superblock->state & SB_CLEAN) && superblock->journalStart != 0) {
+		// not unmounted cleanly. The superblock may be one of the blocks put back
+		replayJournal();
+		pread(diskFd, superblock, BLOCK_SIZE, 0);
+	}
 	
 	if (!validSuperBlock(superblock)) {
 		printf("invalid %x\n", superblock->magic);
+		memset(superblock, 0, BLOCK_SIZE);
 		// if superblock is not valid, we need to initialize the disk fully
 		superblock->blockSize = BLOCK_SIZE;
 		superblock->numBlocks = TOTAL_BLOCKS;
@@ -1265,7 +5871,7 @@ int main(int argc, char *argv[])
 		superblock->firstDataBlock = 1 + superblock->numINodeBlocks;
 		superblock->bitmapBlock = superblock->firstDataBlock;
 		setValidSuperBlock(superblock);
-		writeBlock(0, superblock);
+		buildSummary();
 		// mark first n+2 blocks as used (superblock + n INode blocks + bitmap block)
 		for (i=0; i < 2+superblock->numINodeBlocks; i++) {
 			markBlockUsed(i);
@@ -1273,14 +5879,36 @@ int main(int argc, char *argv[])
 	} 
 	
 	readBlock(superblock->bitmapBlock, bitmap);
+	freedTxn = calloc(sizeof(uint32_t), superblock->numBlocks);
+	if (!(superblock->state & SB_SUMMARY) || 
+			(!(superblock->state & SB_CLEAN) && superblock->journalStart == 0)) {
+		buildSummary();
+	}
 	
 	if (superblock->numINodes == superblock->numFreeINodes) {
 		allocateFile(true); 	// allocate root directory
 	}
+	if (superblock->journalStart == 0) createJournal();
+	if (superblock->shareStart == 0) createShares();
+	if (superblock->dedupStart == 0) createDedup();
+	if (!(superblock->state & SB_SHARED)) findShared();
+	// until closeDisk() says otherwise, the next mount has to replay
+	superblock->state &= ~SB_CLEAN;
+	writeBlock(0, superblock);
+	fdatasync(diskFd);
+	openJournal();
 	
 	printf("Inode size: %d\n", sizeof(INode));
 	
 	handles = calloc(sizeof(FileHandle) * NUM_OPEN_FILES, 1);
+	refs = calloc(sizeof(INodeRef) * superblock->numINodes, 1);
+	tails = calloc(sizeof(TailBuf) * NUM_TAILS, 1);
+	packs = calloc(sizeof(INodeID), NUM_PACKS);
+	for (i=0; i<NUM_TAILS; i++) {
+		tails[i].data = malloc(superblock->blockSize);
+	}
+	dcache = calloc(sizeof(DCacheEntry) * DCACHE_SIZE, 1);
+	ccache = calloc(sizeof(CCacheEntry) * CCACHE_SIZE, 1);
 		
 	sfs_data->flatFile = flatFile;
 	sfs_data->superblock = superblock;
@@ -1288,9 +5916,32 @@ int main(int argc, char *argv[])
 	sfs_data->handles = handles;
 	//******************************************************************/
     
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    sfs_data->attrTimeout = 1.0;
+    sfs_data->entryTimeout = 1.0;
+    if (fuse_opt_parse(&args, sfs_data, sfs_opts, NULL) == -1)
+	sfs_usage();
+    atimeMode = sfs_data->atimeMode;
+    compressFiles = sfs_data->compress;
+    dedupFiles = sfs_data->dedup;
+    discardBlocks = sfs_data->discard;
+    
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+    if (sfs_data->lowLevel) {
+		fuse_stat = sfs_ll_main(&args, sfs_data);
+	} else {
+		// report our own INode numbers, so the attributes readdir hands to
+		// the filler agree with what getattr returns for the same file
+		fuse_opt_add_arg(&args, "-ouse_ino");
+		// the high-level API does its own attribute and name caching
+		char timeouts[64];
+		snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,entry_timeout=%g", 
+			sfs_data->attrTimeout, sfs_data->entryTimeout);
+		fuse_opt_add_arg(&args, timeouts);
+		fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
+	}
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse_opt_free_args(&args);
     return fuse_stat;
 }
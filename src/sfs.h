@@ -5,6 +5,7 @@
 # include <stdint.h>
 # include <time.h>
 # include <stdbool.h>
+# include <sys/types.h>
 
 // cannot exceed 32768 blocks without increasing blocksize!
 // Only 1 block is allocated for the in-use bitmap. 4096*8 = 32768
@@ -17,6 +18,7 @@ typedef uint32_t BlockID;
 
 typedef struct {
 	int flags, size, childCount;
+	int blockCount;		// whole blocks its map holds, indirection blocks too
 	time_t lastAccess, lastModify, lastChange;
 	INodeID blocks[14];
 } INode;
@@ -25,6 +27,57 @@ typedef struct {
 # define INODE_TYPE		0x6
 # define INODE_FILE		0x2
 # define INODE_DIR		0x4
+// unlinked, waiting for its blocks to be freed. An orphan's childCount is
+// the next INode in the superblock's orphan list, 0 at the end
+# define INODE_ORPHAN	0x8
+// a file small enough to keep its bytes in blocks[] rather than in blocks
+# define INODE_INLINE	0x10
+// part of a snapshot, and so read-only
+# define INODE_SNAPSHOT	0x20
+// created under -o compress, so whole clusters it writes are compressed
+# define INODE_COMPRESSED	0x40
+// created under -o dedup, so whole blocks it writes are deduplicated
+# define INODE_DEDUP	0x80
+
+// a directory made in this one, under the root, is a snapshot of the root
+# define SNAPSHOT_DIR	".snapshots"
+
+// most bytes a file can keep inline. It's the INode's block map, so a 
+// bigger file waits for its tail to be packed instead, see FRAG_SIZE
+# define INLINE_SIZE	(14 * sizeof(INodeID))
+
+// the last, partial, block of a file can be packed into fragments of a 
+// tail block shared with other files. It's then mapped as BLOCK_PACKED |
+// block << 8 | first fragment << 4 | fragment count. Fragment 0 of a 
+// tail block holds the mask of fragments in use
+# define FRAG_SIZE			256
+# define FRAGS_PER_BLOCK	(BLOCK_SIZE / FRAG_SIZE)
+# define BLOCK_PACKED		0x80000000
+# define isPacked(id)		(((id) & BLOCK_PACKED) == BLOCK_PACKED)
+# define packID(blk, frag, count)	(BLOCK_PACKED | (blk) << 8 | (frag) << 4 | (count))
+# define packedBlock(id)	(((id) & ~BLOCK_PACKED) >> 8)
+# define packedFrag(id)		(((id) >> 4) & 0xF)
+# define packedCount(id)	((id) & 0xF)
+
+// a compressed file's data is written in clusters of CLUSTER_BLOCKS 
+// blocks, starting at block indexes that are multiples of it. A cluster
+// whose LZ4 compressed form saves a block is kept that way: every block
+// of it is mapped as BLOCK_COMPRESSED, the first ones | the blocks holding
+// the compressed bytes, the rest | 0. The first of those blocks starts 
+// with the compressed length. A compressed cluster always lies wholly 
+// within the file
+# define CLUSTER_BLOCKS		4
+# define BLOCK_COMPRESSED	0x40000000
+# define isCompressed(id)	(((id) & (BLOCK_PACKED | BLOCK_COMPRESSED)) == BLOCK_COMPRESSED)
+# define compressedBlock(id)	((id) & ~BLOCK_COMPRESSED)
+
+// LZ4 looks for matches through a hash table of 1 << LZ4_HASH_BITS 
+// entries. No match starts in the last LZ4_MF_LIMIT bytes, and the last
+// LZ4_LAST_LITERALS are always literals
+# define LZ4_HASH_BITS		12
+# define LZ4_MIN_MATCH		4
+# define LZ4_MF_LIMIT		12
+# define LZ4_LAST_LITERALS	5
 
 typedef struct {
 	char value[124];
@@ -35,6 +88,17 @@ typedef struct {
 # define getType(node)	(node->flags & INODE_TYPE)
 # define isFile(node)	(getType(node) == INODE_FILE)
 # define isDir(node)	(getType(node) == INODE_DIR)
+# define isInline(node)	((node->flags & INODE_INLINE) == INODE_INLINE)
+
+// free blocks are counted per region of REGION_BLOCKS, so the allocator
+// can pass over full regions without looking at their bits
+# define REGION_BLOCKS	512
+# define MAX_REGIONS	(BLOCK_SIZE * 8 / REGION_BLOCKS)
+
+// SuperBlock state
+# define SB_CLEAN		0x1		// unmounted cleanly, the journal is empty
+# define SB_SUMMARY		0x2		// regionFree is kept up to date
+# define SB_SHARED		0x4		// some block has been shared or indexed for dedup
 
 struct SuperBlock {
 	int magic;
@@ -48,14 +112,36 @@ struct SuperBlock {
 	BlockID firstINodeBlock;
 	BlockID firstDataBlock;
 	BlockID bitmapBlock;
+	INodeID orphanHead;		// first orphan, 0 (the root) if there are none
+	BlockID packBlock;		// tail block being filled, 0 for none
+	BlockID journalStart;	// first of the JOURNAL_BLOCKS journal blocks
+	int state;				// SB_ flags
+	BlockID blockHint;		// where the search for a free block starts
+	INodeID inodeHint;		// where the search for a free INode starts
+	uint16_t regionFree[MAX_REGIONS];	// free blocks in each region
+	BlockID shareStart;		// first of the SHARE_BLOCKS blocks of share counts
+	BlockID dedupStart;		// first of the DEDUP_BLOCKS blocks of the dedup index
+	INodeID snapPending;	// snapshot being taken or dropped, 0 for none
 };
 
 # define SUPERBLOCK_MAGIC 0xEF53
 # define validSuperBlock(block) (block->magic == SUPERBLOCK_MAGIC)
 # define setValidSuperBlock(block) block->magic = SUPERBLOCK_MAGIC
 
+// blocks waiting to be freed together, see markBlocksFree()
+typedef struct {
+	BlockID *ids;
+	int count, size;
+} BlockList;
+
+// most blocks an orphan gives back each time its INode is locked
+# define ORPHAN_BATCH	1024
+
 # define NUM_OPEN_FILES 128
 
+// largest write asked of the kernel in -o throughput mode
+# define MAX_WRITE		(1024*1024)
+
 typedef struct {
 	bool inUse;
 	int flags;
@@ -63,4 +149,135 @@ typedef struct {
 	int index;
 } FileHandle;
 
+// what the kernel knows about an INode, used by the low-level API
+typedef struct {
+	uint64_t lookups;	// references handed out by lookup, create and mkdir
+	INodeID parent;		// directory the INode was last looked up in
+	bool unlinked;		// no entries left, free on the last forget
+	time_t openMtime;	// mtime and size when last opened, for keep_cache
+	int openSize;
+	int tail;			// slot in the append buffers + 1, 0 for none
+	uint32_t syncTxn;	// last transaction to change the INode other than its times
+	uint32_t attrTxn;	// last transaction to change only its times
+	bool dataDirty;		// data written in place since the file was last synced
+	time_t packAfter;	// when its tail can be packed, 0 if it isn't queued
+} INodeRef;
+
+// an append buffer, holding the bytes from start to start + len of a file.
+// data is always the last, partial, block of the file
+typedef struct {
+	INodeID id;
+	bool used, dirty;
+	off_t start;
+	int len;
+	time_t dirtySince;
+	char *data;
+} TailBuf;
+
+// number of files that can have appends buffered at once, and how long
+// (seconds) buffered appends can wait to be written
+# define NUM_TAILS		64
+# define TAIL_TIMEOUT	1
+
+// number of files that can wait to have their tails packed, and how long
+// (seconds) a file goes without being released by a writer first
+# define NUM_PACKS		256
+# define PACK_DELAY		5
+
+// the journal: a header block, then a descriptor, the images of one 
+// transaction's blocks and a commit block
+# define JOURNAL_BLOCKS		512
+# define JOURNAL_MAGIC		0x4A524E4C
+// most blocks one transaction can put through the journal; past TXN_MAX
+// blocks a commit is started and new operations wait for it
+# define TXN_CAPACITY		(JOURNAL_BLOCKS - 3)
+# define TXN_MAX			256
+// room an operation sets aside in the running transaction before it
+// starts, so that the ones in flight can't fill it past TXN_CAPACITY.
+// One on a file's blocks (a write of up to MAX_WRITE, truncate,
+// fallocate, a clone) takes OP_BULK: with the share counts, the dedup
+// index and a file's indirection blocks it can change close to 100
+# define OP_BLOCKS			32
+# define OP_BULK			128
+// seconds between commits
+# define JOURNAL_INTERVAL	5
+// buckets in the journal cache
+# define JOURNAL_HASH		1024
+
+// the header, descriptor and commit blocks of the journal
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;		// header: first transaction to replay; else its own
+	uint32_t count;		// descriptor: blocks in the transaction
+	uint32_t checksum;	// descriptor, commit: of the ids and the images
+	BlockID ids[];		// descriptor: where each image belongs
+} JournalHeader;
+
+// a metadata block in the journal cache
+typedef struct JBlock {
+	BlockID id;
+	uint32_t txn;		// last transaction to change it
+	bool dirty;			// changed since the last commit was sealed
+	char *data;
+	struct JBlock *next;
+} JBlock;
+
+// data blocks can be shared by clones of a file. Each block has a count 
+// of the owners it has besides the first; one that has any is copied 
+// before it's written
+# define SHARE_BLOCKS	(TOTAL_BLOCKS * sizeof(uint16_t) / BLOCK_SIZE)
+# define SHARE_MAX		UINT16_MAX
+
+// the dedup index, in DEDUP_BLOCKS metadata blocks: the fingerprint of 
+// every block, 0 for a block not in the index, then DEDUP_BUCKETS 
+// buckets, each the last block indexed whose fingerprint falls in it. A 
+// block in the index is never written in place, like a shared one
+# define DEDUP_BUCKETS	TOTAL_BLOCKS
+# define DEDUP_BLOCKS	((TOTAL_BLOCKS + DEDUP_BUCKETS) * sizeof(uint32_t) / BLOCK_SIZE)
+
+// the argument to SFS_IOC_CLONE, which makes length bytes of the file 
+// open as srcFd at srcOffset share their blocks with the file the ioctl 
+// is made on at offset, like FICLONERANGE. A length of 0 clones the rest
+// of the file
+typedef struct {
+	int64_t srcFd;
+	uint64_t srcOffset;
+	uint64_t length;
+	uint64_t offset;
+} CloneRange;
+
+# define SFS_IOC_CLONE	_IOW('S', 1, CloneRange)
+
+// freed blocks are punched out of the image in batches, every 
+// DISCARD_INTERVAL seconds or once DISCARD_BATCH of them are waiting
+# define DISCARD_INTERVAL	5
+# define DISCARD_BATCH		1024
+// what a block's freedTxn is set to while it's punched out, which keeps
+// it from being allocated
+# define TXN_DISCARDING		UINT32_MAX
+
+// per-INode reader/writer locks are striped over this many locks
+# define INODE_LOCKS 256
+
+// inode numbers reported to FUSE are offset by one, so the root directory
+// (INode 0) gets FUSE's root ID of 1 and no file ever reports st_ino 0
+# define toIno(id)		((ino_t) (id) + 1)
+# define fromIno(ino)	((INodeID) ((ino) - 1))
+
+// lookup cache, mapping a full path to the INode it resolved to
+# define DCACHE_SIZE 1024
+
+typedef struct {
+	char *path;
+	INodeID id;
+} DCacheEntry;
+
+// decompressed clusters, by the first block of their compressed bytes
+# define CCACHE_SIZE 64
+
+typedef struct {
+	BlockID blk;		// 0 for an empty slot
+	char *data;
+} CCacheEntry;
+
 #endif